@@ -0,0 +1,187 @@
+#pragma once
+
+#include <type_traits>
+#include <cstdint>
+#include <functional>
+
+#include <Hart.hpp>
+#include <ControlFlow.hpp>
+
+#include <Translators/DirectTranslator.hpp>
+#include <Translators/CacheWrappedTranslator.hpp>
+#include <Transactors/DirectTransactor.hpp>
+#include <HostMemoryMap.hpp>
+#include <Transactors/TranslatingTransactor.hpp>
+#include <Decoders/DirectDecoder.hpp>
+#include <Decoders/PrecomputedDecoder.hpp>
+
+// Component families for ComposedHart. A translator is built from the hart
+// state and the physical transactor it walks page tables through; a virtual
+// transactor from the translator and the physical transactor.
+
+template<typename XLEN_t, typename PATransactorT>
+using CachedTranslator = CacheWrappedTranslator<XLEN_t, 8, DirectTranslator<XLEN_t, PATransactorT>>;
+
+template<typename XLEN_t, typename TranslatorT, typename PATransactorT>
+using ImmediateTransactor = TranslatingTransactor<XLEN_t, false, TranslatorT, PATransactorT>;
+
+template<typename XLEN_t, typename TranslatorT, typename PATransactorT>
+using BufferedTransactor = TranslatingTransactor<XLEN_t, true, TranslatorT, PATransactorT>;
+
+// A hart put together from components chosen at compile time. Each component
+// holds its neighbours by their concrete types, so calls between them are
+// direct and can be inlined. The defaults match SimpleHart.
+template<typename XLEN_t,
+         template<typename> class DecoderT = DirectDecoder,
+         template<typename, typename> class TranslatorT = DirectTranslator,
+         template<typename, typename, typename> class VATransactorT = BufferedTransactor,
+         template<typename> class PATransactorT = DirectTransactor>
+class ComposedHart final : public Hart<XLEN_t> {
+
+private:
+
+    using PATransactor = PATransactorT<XLEN_t>;
+    using Translator = TranslatorT<XLEN_t, PATransactor>;
+    using VATransactor = VATransactorT<XLEN_t, Translator, PATransactor>;
+
+    PATransactor paTransactor;
+    Translator translator;
+    VATransactor vaTransactor;
+    DecoderT<XLEN_t> decoder;
+
+public:
+
+    ComposedHart(CASK::IOTarget* bus, __uint32_t maximalExtensions) :
+        Hart<XLEN_t>(maximalExtensions),
+        paTransactor(bus),
+        translator(&this->state, &paTransactor),
+        vaTransactor(&translator, &paTransactor),
+        decoder(&this->state) {
+        this->state.implCallback = std::bind(&ComposedHart::Callback, this, std::placeholders::_1);
+        Reset();
+    };
+
+    virtual inline unsigned int Tick() override {
+
+        __uint32_t encoding = 0;
+        while (true) {
+            Transaction<XLEN_t> transaction = vaTransactor.Fetch(this->state.pc, sizeof(encoding), (char*)&encoding);
+            if (transaction.trapCause != RISCV::TrapCause::NONE) {
+                PERF_COUNT(this->perf.traps);
+                TRACE(RecordTrap(this->state.pc));
+                this->state.RaiseException(transaction.trapCause, this->state.pc);
+                continue;
+            }
+            break;
+        }
+
+        TRACE(RecordInstruction(this->state.pc, encoding));
+        // Follows the XLEN of the current privilege mode; cheap when unchanged.
+        decoder.Configure(&this->state);
+#ifdef HARTMODELS_TRACE
+        XLEN_t pc = this->state.pc;
+        ControlFlow flow = ClassifyControlFlow(encoding, &this->state);
+        bool traps = flow == ControlFlow::Checked && WillTrap(encoding, &this->state);
+#endif
+        decoder.Decode(encoding)(encoding, &this->state, &vaTransactor);
+#ifdef HARTMODELS_TRACE
+        if (this->state.pc != pc + ((encoding & 0b11) == 0b11 ? 4 : 2) &&
+            (flow == ControlFlow::FallsThrough || traps)) {
+            TRACE(RecordTrap(pc));
+        }
+#endif
+        if (this->profiler != nullptr) [[ unlikely ]] {
+            this->profiler->Advance(1, &this->state, [this](XLEN_t address, XLEN_t* value) {
+                return this->PeekHostMemory(address, value);
+            });
+        }
+        return 1;
+    };
+
+    virtual inline void Reset() override {
+        this->state.Reset(this->resetVector);
+        ClearTranslations();
+        decoder.Configure(&this->state);
+    };
+
+    virtual inline Transactor<XLEN_t>* getVATransactor() override {
+        return &vaTransactor;
+    }
+
+    virtual SegmentsTransaction<XLEN_t> ReadSegments(const TransferSegment<XLEN_t>* segments, size_t count) override {
+        if constexpr (requires { vaTransactor.template TransactSegments<IOVerb::Read>(segments, count); }) {
+            return vaTransactor.template TransactSegments<IOVerb::Read>(segments, count);
+        } else {
+            return this->TransactSegments(segments, count, false);
+        }
+    }
+
+    virtual SegmentsTransaction<XLEN_t> WriteSegments(const TransferSegment<XLEN_t>* segments, size_t count) override {
+        if constexpr (requires { vaTransactor.template TransactSegments<IOVerb::Write>(segments, count); }) {
+            return vaTransactor.template TransactSegments<IOVerb::Write>(segments, count);
+        } else {
+            return this->TransactSegments(segments, count, true);
+        }
+    }
+
+    virtual void AttachHostMemory(const HostMemoryMap<XLEN_t>* map) override {
+        Hart<XLEN_t>::AttachHostMemory(map);
+        if constexpr (requires { paTransactor.SetHostMemoryMap(map); }) {
+            paTransactor.SetHostMemoryMap(map);
+            ClearTranslations();
+        }
+    }
+
+    virtual void AttachTrace(TraceRecorder* recorder) override {
+        this->trace = recorder;
+        if constexpr (requires { vaTransactor.trace = recorder; }) {
+            vaTransactor.trace = recorder;
+        }
+    }
+
+    // The hart's own counters plus those of whichever components keep any.
+    virtual inline PerfCounters getPerfCounters() override {
+        PerfCounters counters = this->perf;
+        if constexpr (requires { paTransactor.perf; }) {
+            counters += paTransactor.perf;
+        }
+        if constexpr (requires { translator.perf; }) {
+            counters += translator.perf;
+        }
+        if constexpr (requires { vaTransactor.perf; }) {
+            counters += vaTransactor.perf;
+        }
+        if constexpr (requires { decoder.perf; }) {
+            counters += decoder.perf;
+        }
+        return counters;
+    }
+
+    virtual void Restore(const HartSnapshot<XLEN_t>& snapshot) override {
+        Hart<XLEN_t>::Restore(snapshot);
+        ClearTranslations();
+        decoder.Configure(&this->state);
+    }
+
+private:
+
+    inline void ClearTranslations() {
+        if constexpr (requires { translator.Clear(); }) {
+            translator.Clear();
+        }
+    }
+
+    inline void Callback(HartCallbackArgument arg) {
+        if (arg == HartCallbackArgument::RequestedVMfence) {
+            ClearTranslations();
+        }
+        if (arg == HartCallbackArgument::ChangedMISA) {
+            decoder.Configure(&this->state);
+        }
+    }
+
+};
+
+// Translation cache in front of the page walker, with all-or-nothing accesses.
+template<typename XLEN_t>
+using CachedBufferedHart = ComposedHart<XLEN_t, PrecomputedDecoder, CachedTranslator, BufferedTransactor>;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+
+#include <HartState.hpp>
+#include <RiscV.hpp>
+
+#include <EffectiveXlen.hpp>
+
+// How an instruction can leave pc somewhere other than the next instruction,
+// so harts can tell a trap from a jump by what the instruction is rather than
+// by where execution went:
+//   FallsThrough: only by trapping.
+//   Jumps:        only by jumping, to a target that can't be misaligned.
+//   Checked:      either; WillTrap() says which, when asked before it runs.
+enum class ControlFlow : __uint8_t {
+    FallsThrough,
+    Jumps,
+    Checked,
+};
+
+template<typename XLEN_t>
+inline ControlFlow ClassifyControlFlow(__uint32_t encoding, HartState<XLEN_t>* state) {
+    // With C, every jump target is at least 2-byte aligned.
+    bool alignedTargets = state->misa.extensions & (1 << ('C' - 'A'));
+    if ((encoding & 0b11) != 0b11) {
+        __uint32_t quadrant = encoding & 0b11;
+        __uint32_t funct3 = (encoding >> 13) & 0b111;
+        if (quadrant == 0b01) {
+            // c.j, c.beqz, c.bnez, and c.jal where XLEN is 32 (c.addiw elsewhere)
+            bool jal = funct3 == 0b001 && EffectiveXlen(state) == RISCV::XlenMode::XL32;
+            return jal || funct3 == 0b101 || funct3 == 0b110 || funct3 == 0b111 ?
+                ControlFlow::Jumps : ControlFlow::FallsThrough;
+        }
+        if (quadrant == 0b10 && funct3 == 0b100 && ((encoding >> 2) & 0b11111) == 0 && ((encoding >> 7) & 0b11111) != 0) {
+            // c.jr, c.jalr
+            return ControlFlow::Jumps;
+        }
+        return ControlFlow::FallsThrough;
+    }
+    switch (encoding & 0b1111111) {
+    case 0b1100011: // BRANCH, with imm[1] in bit 8
+        if (alignedTargets || (encoding & (1 << 8)) == 0) {
+            return ControlFlow::Jumps;
+        }
+        // Taken, it traps; otherwise it falls through.
+        return ControlFlow::FallsThrough;
+    case 0b1101111: // JAL, with imm[1] in bit 21
+        return alignedTargets || (encoding & (1 << 21)) == 0 ? ControlFlow::Jumps : ControlFlow::FallsThrough;
+    case 0b1100111: // JALR
+        return alignedTargets ? ControlFlow::Jumps : ControlFlow::Checked;
+    case 0b1110011: // SYSTEM
+        return encoding == 0x30200073 || encoding == 0x10200073 ? ControlFlow::Checked : ControlFlow::FallsThrough;
+    default:
+        return ControlFlow::FallsThrough;
+    }
+}
+
+// Whether a Checked instruction is about to trap rather than jump.
+template<typename XLEN_t>
+inline bool WillTrap(__uint32_t encoding, HartState<XLEN_t>* state) {
+    if (encoding == 0x30200073) { // MRET
+        return state->privilegeMode != RISCV::PrivilegeMode::Machine;
+    }
+    if (encoding == 0x10200073) { // SRET
+        return !(state->misa.extensions & (1 << ('S' - 'A'))) ||
+               state->privilegeMode == RISCV::PrivilegeMode::User ||
+               (state->privilegeMode == RISCV::PrivilegeMode::Supervisor && state->mstatus.tsr);
+    }
+    // JALR without C
+    XLEN_t offset = (XLEN_t)(__int64_t)((__int32_t)encoding >> 20);
+    return ((state->regs[(encoding >> 15) & 0b11111] + offset) & 0b10) != 0;
+}
@@ -3,6 +3,8 @@
 #include <Decoder.hpp>
 #include <RiscVDecoder.hpp>
 
+#include <EffectiveXlen.hpp>
+
 template<typename XLEN_t>
 class DirectDecoder final : public Decoder<XLEN_t> {
 
@@ -21,7 +23,7 @@ public:
     }
 
     DecodedInstruction<XLEN_t> Decode(__uint32_t encoded) override {
-        return decode_instruction<XLEN_t>(encoded, state->misa.extensions, state->misa.mxlen).executionFunction;
+        return decode_instruction<XLEN_t>(encoded, state->misa.extensions, EffectiveXlen(state)).executionFunction;
     }
 
 };
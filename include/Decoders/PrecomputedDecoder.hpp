@@ -1,72 +1,176 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <vector>
 
 #include <Decoder.hpp>
-#include <Decoders/DirectDecoder.hpp>
+#include <RiscVDecoder.hpp>
 
 #include <RiscV.hpp>
 
+#include <EffectiveXlen.hpp>
+#include <PerfCounters.hpp>
+
 template<typename XLEN_t>
 class PrecomputedDecoder final : public Decoder<XLEN_t> {
 
 private:
 
-    __uint32_t configured_extensions;
-    RISCV::XlenMode configured_mxlen;
-    std::array<DecodedInstruction<XLEN_t>, 1 << 20> uncompressed;
-    std::array<DecodedInstruction<XLEN_t>, 1 << 16> compressed;
+    // The decode tables for one (extensions, xlen) configuration, shared by
+    // every decoder configured that way. Lookups take two steps: the opcode
+    // and funct3 pick a group, and the group's entry is either the one
+    // handler every encoding in it decodes to, or a block of handler IDs
+    // indexed by the group's other significant bits (31:20 of 32-bit
+    // encodings, 12:2 of compressed ones). IDs index one compact array of
+    // handlers, and groups with identical blocks share one, so the tables
+    // stay small enough to live in L2 instead of spreading lookups across
+    // megabytes of duplicate pointers.
+    //
+    // A group is decoded in full the first time it's used, under fillLock,
+    // and published with a release store, so lookups never lock. An entry is
+    // 0 until then, (ID << 1 | 1) for a uniform group, or else a pointer to
+    // its block.
+    struct Tables {
+        __uint32_t extensions;
+        RISCV::XlenMode xlen;
+        std::uintptr_t uncompressed[1 << 8] = {};
+        std::uintptr_t compressed[1 << 5] = {};
+        DecodedInstruction<XLEN_t>* handlers;
+        std::mutex fillLock;
+        std::map<std::uintptr_t, __uint16_t> handlerIDs;
+        std::set<std::vector<__uint16_t>> blocks;
+        Tables(__uint32_t extensions, RISCV::XlenMode xlen) :
+            extensions(extensions),
+            xlen(xlen),
+            handlers((DecodedInstruction<XLEN_t>*)calloc(1 << 16, sizeof(DecodedInstruction<XLEN_t>))) {
+            if (handlers == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        ~Tables() {
+            free(handlers);
+        }
+    };
+
+    // Tables for each XLEN this decoder has run at, indexed by XlenMode, so
+    // switching between privilege modes that run at different XLENs never
+    // rebuilds anything.
+    std::shared_ptr<Tables> tablesByXlen[4];
+    Tables* tables = nullptr;
 
 public:
 
-    PrecomputedDecoder(HartState<XLEN_t>* hartState) :
-        configured_extensions(0),
-        configured_mxlen(RISCV::XlenMode::XL128) {
+    PerfCounters perf;
+
+    PrecomputedDecoder(HartState<XLEN_t>* hartState) {
         Configure(hartState);
     }
 
     void Configure(HartState<XLEN_t>* state) override {
 
         // Skip reconfiguration when nothing has changed.
-        if (state->misa.extensions == configured_extensions &&
-            state->misa.mxlen == configured_mxlen) {
+        RISCV::XlenMode xlen = EffectiveXlen(state);
+        if (tables != nullptr &&
+            state->misa.extensions == tables->extensions &&
+            xlen == tables->xlen) {
             return;
         }
 
-        configured_extensions = state->misa.extensions;
-        configured_mxlen = state->misa.mxlen;
-
-        DirectDecoder decoder(state);
-
-        for (__uint32_t packed = 0; packed < (1<<20); packed++) {
-            uncompressed[packed] = decoder.Decode(Unpack(packed));
-        }
-
-        for (__uint32_t encoded = 0; encoded < 1<<16; encoded++) {
-            if ((encoded & 0b11) != 0b11) {
-                compressed[encoded] = decoder.Decode(encoded);
+        if (tables != nullptr && state->misa.extensions != tables->extensions) {
+            for (std::shared_ptr<Tables>& cached : tablesByXlen) {
+                cached = nullptr;
             }
         }
+        std::shared_ptr<Tables>& cached = tablesByXlen[(unsigned int)xlen & 0b11];
+        if (cached == nullptr) {
+            PERF_COUNT(perf.decoderRebuilds);
+            cached = Acquire(state->misa.extensions, xlen);
+        }
+        tables = cached.get();
     }
 
     DecodedInstruction<XLEN_t> Decode(__uint32_t encoded) override {
         if (RISCV::isCompressed(encoded)) {
-            return compressed[encoded & 0x0000ffff];
+            return Lookup<true>(((encoded >> 11) & 0b11100) | (encoded & 0b11), (encoded >> 2) & 0x7ff);
         }
-        return uncompressed[Pack(encoded)];
+        return Lookup<false>(((encoded >> 7) & 0b11100000) | ((encoded >> 2) & 0b11111), encoded >> 20);
     }
 
 private:
 
-    __uint32_t Pack(__uint32_t encoded) {
-        return swizzle<__uint32_t, ExtendBits::Zero, 31, 20, 14, 12, 6, 2>(encoded);
+    static std::shared_ptr<Tables> Acquire(__uint32_t extensions, RISCV::XlenMode xlen) {
+        static std::mutex registryLock;
+        static std::map<std::pair<__uint32_t, RISCV::XlenMode>, std::weak_ptr<Tables>> registry;
+        std::lock_guard<std::mutex> guard(registryLock);
+        auto found = registry.find({extensions, xlen});
+        if (found != registry.end()) {
+            std::shared_ptr<Tables> shared = found->second.lock();
+            if (shared != nullptr) {
+                return shared;
+            }
+        }
+        // Tables no decoder holds any more have been freed; drop their entries
+        // before adding one.
+        std::erase_if(registry, [](const auto& entry) { return entry.second.expired(); });
+        std::shared_ptr<Tables> shared = std::make_shared<Tables>(extensions, xlen);
+        registry[{extensions, xlen}] = shared;
+        return shared;
+    }
+
+    template<bool isCompressed>
+    inline DecodedInstruction<XLEN_t> Lookup(unsigned int group, unsigned int offset) {
+        std::uintptr_t* groups = isCompressed ? tables->compressed : tables->uncompressed;
+        std::uintptr_t entry = std::atomic_ref(groups[group]).load(std::memory_order_acquire);
+        if (entry == 0) [[ unlikely ]] {
+            entry = FillGroup<isCompressed>(group);
+        }
+        __uint16_t id = (entry & 1) ? entry >> 1 : ((const __uint16_t*)entry)[offset];
+        return tables->handlers[id];
     }
 
-    __uint32_t Unpack(__uint32_t packed) {
-        return 0b11 |
-            ((0b00000000000000011111 & packed) << 2) |
-            ((0b00000000000011100000 & packed) << 7) |
-            ((0b11111111111100000000 & packed) << 12);
+    // Register fields (11:7 and 19:15 of 32-bit encodings) don't affect
+    // decoding, so each group is decoded with them zeroed.
+    template<bool isCompressed>
+    std::uintptr_t FillGroup(unsigned int group) {
+        std::uintptr_t* groups = isCompressed ? tables->compressed : tables->uncompressed;
+        std::lock_guard<std::mutex> guard(tables->fillLock);
+        std::uintptr_t entry = std::atomic_ref(groups[group]).load(std::memory_order_relaxed);
+        if (entry != 0) {
+            return entry;
+        }
+        constexpr unsigned int blockSize = isCompressed ? 1 << 11 : 1 << 12;
+        std::vector<__uint16_t> block(blockSize);
+        bool uniform = true;
+        for (unsigned int offset = 0; offset < blockSize; offset++) {
+            __uint32_t encoded = isCompressed ?
+                ((group & 0b11100) << 11) | (offset << 2) | (group & 0b11) :
+                (offset << 20) | ((group & 0b11100000) << 7) | ((group & 0b11111) << 2) | 0b11;
+            block[offset] = HandlerID(decode_instruction<XLEN_t>(encoded, tables->extensions, tables->xlen).executionFunction);
+            uniform &= block[offset] == block[0];
+        }
+        if (uniform) {
+            entry = ((std::uintptr_t)block[0] << 1) | 1;
+        } else {
+            entry = (std::uintptr_t)tables->blocks.insert(std::move(block)).first->data();
+        }
+        std::atomic_ref(groups[group]).store(entry, std::memory_order_release);
+        return entry;
+    }
+
+    // An ISA has nowhere near 65536 distinct execution functions.
+    __uint16_t HandlerID(DecodedInstruction<XLEN_t> handler) {
+        auto [found, inserted] = tables->handlerIDs.try_emplace((std::uintptr_t)handler, tables->handlerIDs.size());
+        if (inserted) {
+            tables->handlers[found->second] = handler;
+        }
+        return found->second;
     }
 
 };
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <HartState.hpp>
+#include <RiscV.hpp>
+
+// The XLEN instructions run at in the hart's current privilege mode: MXLEN in
+// M-mode, SXLEN in S-mode and UXLEN in U-mode. RV32 has no SXL or UXL fields,
+// and they read 0 where a hart doesn't implement them; either way the mode
+// runs at MXLEN.
+template<typename XLEN_t>
+inline RISCV::XlenMode EffectiveXlen(HartState<XLEN_t>* state) {
+    if constexpr (sizeof(XLEN_t) == 4) {
+        return state->misa.mxlen;
+    }
+    unsigned int field = 0;
+    switch (state->privilegeMode) {
+    case RISCV::PrivilegeMode::Supervisor:
+        field = state->mstatus.sxl;
+        break;
+    case RISCV::PrivilegeMode::User:
+        field = state->mstatus.uxl;
+        break;
+    default:
+        break;
+    }
+    return field == 0 ? state->misa.mxlen : (RISCV::XlenMode)field;
+}
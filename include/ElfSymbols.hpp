@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Function symbols from a little-endian ELF32 or ELF64 file's symbol table,
+// for turning guest addresses back into names.
+class ElfSymbols final {
+
+private:
+
+    struct Symbol {
+        __uint64_t start;
+        __uint64_t size;
+        std::string name;
+    };
+    std::vector<Symbol> symbols;
+
+    static constexpr __uint32_t sectionTypeSymbolTable = 2;
+    static constexpr unsigned char symbolTypeFunction = 2;
+
+public:
+
+    // Returns false, leaving any symbols loaded before, if the file can't be
+    // read or isn't an ELF file this understands.
+    bool Load(const char* path) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> image((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (image.size() < 0x34 || memcmp(image.data(), "\x7f" "ELF", 4) != 0 || image[5] != 1) {
+            return false;
+        }
+        bool wide = image[4] == 2;
+        __uint64_t sectionTable = wide ? Get<__uint64_t>(image, 0x28) : Get<__uint32_t>(image, 0x20);
+        __uint16_t sectionSize = Get<__uint16_t>(image, wide ? 0x3a : 0x2e);
+        __uint16_t sectionCount = Get<__uint16_t>(image, wide ? 0x3c : 0x30);
+        for (unsigned int i = 0; i < sectionCount; i++) {
+            __uint64_t section = sectionTable + i * sectionSize;
+            if (Get<__uint32_t>(image, section + 4) != sectionTypeSymbolTable) {
+                continue;
+            }
+            __uint64_t table = wide ? Get<__uint64_t>(image, section + 0x18) : Get<__uint32_t>(image, section + 0x10);
+            __uint64_t tableSize = wide ? Get<__uint64_t>(image, section + 0x20) : Get<__uint32_t>(image, section + 0x14);
+            __uint32_t link = Get<__uint32_t>(image, section + (wide ? 0x28 : 0x18));
+            __uint64_t stringSection = sectionTable + link * sectionSize;
+            __uint64_t strings = wide ? Get<__uint64_t>(image, stringSection + 0x18) : Get<__uint32_t>(image, stringSection + 0x10);
+            unsigned int entrySize = wide ? 24 : 16;
+            for (__uint64_t entry = table; entry + entrySize <= table + tableSize; entry += entrySize) {
+                unsigned char info = Get<unsigned char>(image, entry + (wide ? 4 : 12));
+                if ((info & 0xf) != symbolTypeFunction) {
+                    continue;
+                }
+                __uint64_t value = wide ? Get<__uint64_t>(image, entry + 8) : Get<__uint32_t>(image, entry + 4);
+                __uint64_t size = wide ? Get<__uint64_t>(image, entry + 16) : Get<__uint32_t>(image, entry + 8);
+                __uint64_t name = strings + Get<__uint32_t>(image, entry);
+                if (name >= image.size()) {
+                    continue;
+                }
+                symbols.push_back({ value, size, std::string(image.data() + name, strnlen(image.data() + name, image.size() - name)) });
+            }
+        }
+        std::sort(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) { return a.start < b.start; });
+        return true;
+    }
+
+    // The function containing address, or the address in hex if none does.
+    std::string Name(__uint64_t address) const {
+        auto after = std::upper_bound(symbols.begin(), symbols.end(), address,
+            [](__uint64_t address, const Symbol& symbol) { return address < symbol.start; });
+        if (after != symbols.begin()) {
+            const Symbol& symbol = *(after - 1);
+            if (symbol.size == 0 || address - symbol.start < symbol.size) {
+                return symbol.name;
+            }
+        }
+        char hex[24];
+        snprintf(hex, sizeof(hex), "0x%llx", (unsigned long long)address);
+        return hex;
+    }
+
+private:
+
+    // Reads past the end of the file come back as zero.
+    template<typename T>
+    static T Get(const std::vector<char>& image, __uint64_t offset) {
+        T value = 0;
+        if (offset + sizeof(T) <= image.size()) {
+            memcpy(&value, image.data() + offset, sizeof(T));
+        }
+        return value;
+    }
+
+};
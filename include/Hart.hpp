@@ -1,11 +1,34 @@
 #pragma once
 
+#include <cstring>
+#include <memory>
+
 #include <HartState.hpp>
 #include <Translator.hpp>
 #include <Transactor.hpp>
 
 #include <Tickable.hpp>
 
+#include <HostMemoryMap.hpp>
+#include <PerfCounters.hpp>
+#include <SamplingProfiler.hpp>
+#include <TraceRecorder.hpp>
+#include <TransferSegment.hpp>
+
+// Whatever else a hart model keeps in a snapshot, e.g. its warm caches.
+struct HartSnapshotExtra {
+    virtual ~HartSnapshotExtra() = default;
+};
+
+// A saved hart, restorable any number of times into any hart of the same
+// model. Guest memory is not part of it.
+template<typename XLEN_t>
+struct HartSnapshot {
+    HartState<XLEN_t> state;
+    XLEN_t resetVector;
+    std::shared_ptr<const HartSnapshotExtra> extra;
+};
+
 template<typename XLEN_t>
 class Hart : public CASK::Tickable {
 
@@ -16,8 +39,113 @@ public:
     virtual inline unsigned int Tick() override = 0;
     virtual inline void Reset() override { }
     virtual  inline Transactor<XLEN_t>* getVATransactor() = 0; // TODO this should be something more private
+    // All zero unless built with HARTMODELS_PERF_COUNTERS.
+    virtual inline PerfCounters getPerfCounters() { return perf; }
+
+    // Scatter-gather access to guest virtual memory, for bulk copies and DMA
+    // through the hart's address space. Faults are reported at the byte they
+    // hit, with everything before it transferred.
+    virtual SegmentsTransaction<XLEN_t> ReadSegments(const TransferSegment<XLEN_t>* segments, size_t count) {
+        return TransactSegments(segments, count, false);
+    }
+
+    virtual SegmentsTransaction<XLEN_t> WriteSegments(const TransferSegment<XLEN_t>* segments, size_t count) {
+        return TransactSegments(segments, count, true);
+    }
+
+    // Let physical accesses that land in map's regions skip the bus, for the
+    // models that can.
+    virtual void AttachHostMemory(const HostMemoryMap<XLEN_t>* map) {
+        hostMemory = map;
+    }
+
+    // Record into recorder, or stop recording with nullptr. The recorder
+    // stays the caller's, and must outlive its attachment. Does nothing
+    // unless built with HARTMODELS_TRACE.
+    virtual void AttachTrace(TraceRecorder* recorder) {
+        trace = recorder;
+    }
+
+    // Sample into profiler, or stop sampling with nullptr. A profiler belongs
+    // to one hart at a time.
+    virtual void AttachProfiler(SamplingProfiler<XLEN_t>* samplingProfiler) {
+        profiler = samplingProfiler;
+    }
+
+    virtual HartSnapshot<XLEN_t> Snapshot() {
+        return { state, resetVector, nullptr };
+    }
+
+    // The restored state keeps this hart's own implCallback.
+    virtual void Restore(const HartSnapshot<XLEN_t>& snapshot) {
+        auto callback = state.implCallback;
+        state = snapshot.state;
+        state.implCallback = callback;
+        resetVector = snapshot.resetVector;
+    }
+
+    // Carry on from wherever other, a hart of any model, has got to, e.g. to
+    // fast-forward with one model and switch to a detailed one for a while.
+    // Only the architectural state moves over. Whatever this hart had cached
+    // is revalidated as for a cold restore, since other's run may have made
+    // it stale, and each hart keeps its own implCallback.
+    virtual void TakeOver(const Hart<XLEN_t>& other) {
+        Restore({ other.state, other.resetVector, nullptr });
+    }
 
     HartState<XLEN_t> state;
     XLEN_t resetVector;
 
+protected:
+
+    // A page at a time through the virtual transactor, for models without a
+    // bulk path, so a fault still can't hide behind an earlier page.
+    SegmentsTransaction<XLEN_t> TransactSegments(const TransferSegment<XLEN_t>* segments, size_t count, bool write) {
+        SegmentsTransaction<XLEN_t> result = { RISCV::TrapCause::NONE, 0, 0 };
+        Transactor<XLEN_t>* transactor = getVATransactor();
+        for (size_t i = 0; i < count; i++) {
+            for (XLEN_t done = 0; done < segments[i].size;) {
+                XLEN_t address = segments[i].address + done;
+                XLEN_t chunkSize = 0x1000 - (address & 0xfff);
+                if (chunkSize > segments[i].size - done) {
+                    chunkSize = segments[i].size - done;
+                }
+                Transaction<XLEN_t> transaction = write ?
+                    transactor->Write(address, chunkSize, segments[i].buf + done) :
+                    transactor->Read(address, chunkSize, segments[i].buf + done);
+                result.transferred += transaction.transferredSize;
+                if (transaction.trapCause != RISCV::TrapCause::NONE || transaction.transferredSize != chunkSize) {
+                    result.trapCause = transaction.trapCause;
+                    result.faultAddress = address + transaction.transferredSize;
+                    return result;
+                }
+                done += chunkSize;
+            }
+        }
+        return result;
+    }
+
+    // Read a guest word straight from the host memory map, for models that
+    // hold no host pointers of their own. Only with translation off, since a
+    // page walk could reach the bus; false whenever it can't be done without
+    // side effects.
+    bool PeekHostMemory(XLEN_t address, XLEN_t* value) {
+        RISCV::PrivilegeMode privilege = state.mstatus.mprv ? state.mstatus.mpp : state.privilegeMode;
+        if (hostMemory == nullptr ||
+            (state.satp.pagingMode != RISCV::PagingMode::Bare && privilege != RISCV::PrivilegeMode::Machine)) {
+            return false;
+        }
+        char* host = hostMemory->Find(address, sizeof(XLEN_t));
+        if (host == nullptr) {
+            return false;
+        }
+        memcpy(value, host, sizeof(XLEN_t));
+        return true;
+    }
+
+    PerfCounters perf;
+    TraceRecorder* trace = nullptr;
+    const HostMemoryMap<XLEN_t>* hostMemory = nullptr;
+    SamplingProfiler<XLEN_t>* profiler = nullptr;
+
 };
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Tickable.hpp>
+
+#include <OptimizedHart.hpp>
+
+// Runs a set of harts that share one memory on a pool of host threads. Each
+// Tick() is one round: every hart runs its quantum, then all meet at a
+// barrier. Harts are attached to each other so that guest atomics stay atomic
+// across threads, and so that a fence on one hart is delivered to the others
+// at their next quantum boundary, the way an IPI-driven remote fence would be.
+template<typename HartType>
+class HartScheduler final : public CASK::Tickable {
+
+private:
+
+    std::vector<HartType*> harts;
+    std::vector<unsigned int> retired;
+    std::vector<std::thread> workers;
+    std::mutex atomicsLock;
+    std::barrier<> roundStart;
+    std::barrier<> roundEnd;
+    std::atomic<bool> exiting = false;
+    unsigned int threadCount;
+    std::mutex idleLock;
+    std::condition_variable idleWake;
+    bool woken = false;
+
+public:
+
+    HartScheduler(std::vector<HartType*> schedulerHarts, unsigned int threads, unsigned int quantum = 10000) :
+        harts(schedulerHarts),
+        retired(schedulerHarts.size()),
+        roundStart(threads),
+        roundEnd(threads),
+        threadCount(threads) {
+        for (unsigned int i = 0; i < harts.size(); i++) {
+            harts[i]->quantum = quantum;
+            harts[i]->AttachSMP(&atomicsLock, [this, i](HartCallbackArgument arg) {
+                for (unsigned int j = 0; j < harts.size(); j++) {
+                    if (j != i) {
+                        harts[j]->RemoteFence(arg);
+                    }
+                }
+            });
+        }
+        // The thread calling Tick() does the share for worker 0.
+        for (unsigned int worker = 1; worker < threadCount; worker++) {
+            workers.emplace_back([this, worker]() {
+                while (true) {
+                    roundStart.arrive_and_wait();
+                    if (exiting.load()) {
+                        return;
+                    }
+                    RunShare(worker);
+                    roundEnd.arrive_and_wait();
+                }
+            });
+        }
+    }
+
+    ~HartScheduler() {
+        exiting.store(true);
+        roundStart.arrive_and_wait();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Returns the longest quantum any hart retired this round, which is how
+    // far simulated time moved while they all ran side by side.
+    virtual inline unsigned int Tick() override {
+        roundStart.arrive_and_wait();
+        RunShare(0);
+        roundEnd.arrive_and_wait();
+        unsigned int elapsed = 0;
+        for (unsigned int count : retired) {
+            elapsed = count > elapsed ? count : elapsed;
+        }
+        return elapsed;
+    }
+
+    virtual inline void Reset() override {
+        for (HartType* hart : harts) {
+            hart->Reset();
+        }
+    }
+
+    void SetQuantum(unsigned int quantum) {
+        for (HartType* hart : harts) {
+            hart->quantum = quantum;
+        }
+    }
+
+    // True when every hart was parked in WFI at the end of its last quantum,
+    // so nothing happens until a timer or device raises an interrupt. Safe to
+    // call while the harts are running.
+    bool Idle() {
+        for (HartType* hart : harts) {
+            if (!hart->IsParked()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Block the calling thread while every hart is idle, until Wake() is
+    // called or timeout (e.g. the time to the next timer event) runs out.
+    template<typename Rep, typename Period>
+    void WaitWhileIdle(std::chrono::duration<Rep, Period> timeout) {
+        std::unique_lock<std::mutex> guard(idleLock);
+        idleWake.wait_for(guard, timeout, [this]() { return woken || !Idle(); });
+        woken = false;
+    }
+
+    // Safe to call from any thread, after raising an interrupt on a hart.
+    void Wake() {
+        {
+            std::lock_guard<std::mutex> guard(idleLock);
+            woken = true;
+        }
+        idleWake.notify_all();
+    }
+
+private:
+
+    inline void RunShare(unsigned int worker) {
+        for (unsigned int i = worker; i < harts.size(); i += threadCount) {
+            retired[i] = harts[i]->Tick();
+        }
+    }
+
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <Transactor.hpp>
+
+// Physical address ranges backed directly by host memory, e.g. the RAM behind
+// each PhysicalMemory the platform maps. Accesses that land in one can be
+// done with a memcpy instead of a trip across the bus. Fill it in before the
+// harts that use it start running; lookups don't lock.
+template<typename XLEN_t>
+class HostMemoryMap final {
+
+private:
+
+    struct Region {
+        XLEN_t start;
+        XLEN_t last;
+        char* host;
+    };
+    std::vector<Region> regions;
+
+public:
+
+    void Add(XLEN_t start, XLEN_t size, char* host) {
+        regions.push_back({ start, start + size - 1, host });
+        std::sort(regions.begin(), regions.end(), [](const Region& a, const Region& b) { return a.start < b.start; });
+    }
+
+    void Clear() {
+        regions.clear();
+    }
+
+    // The host address of [address, address + size), or nullptr unless it all
+    // lies within one region. There are only ever a handful of regions.
+    inline char* Find(XLEN_t address, XLEN_t size) const {
+        for (const Region& region : regions) {
+            if (address - region.start <= region.last - region.start) {
+                if (size - 1 > region.last - address) {
+                    return nullptr;
+                }
+                return region.host + (address - region.start);
+            }
+        }
+        return nullptr;
+    }
+
+    // The host memory of the region holding host, as [start, end), or false
+    // if it isn't in any.
+    inline bool HostRange(const char* host, const char** start, const char** end) const {
+        for (const Region& region : regions) {
+            std::uintptr_t offset = (std::uintptr_t)host - (std::uintptr_t)region.host;
+            if (offset <= region.last - region.start) {
+                *start = region.host;
+                *end = region.host + (region.last - region.start) + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Whether [host, host + size) lies within one region's host memory.
+    inline bool Covers(const char* host, size_t size) const {
+        const char* start;
+        const char* end;
+        return HostRange(host, &start, &end) && size <= (size_t)(end - host);
+    }
+
+};
+
+// A physical-address transactor that serves registered host memory itself
+// and only sends everything else to the bus. Page table walks go through one
+// of these, so PTE reads from RAM skip the bus dispatch.
+template<typename XLEN_t>
+class HostMappedTransactor final : public Transactor<XLEN_t> {
+
+private:
+
+    CASK::IOTarget* target;
+    const HostMemoryMap<XLEN_t>* map = nullptr;
+
+public:
+
+    HostMappedTransactor(CASK::IOTarget* ioTarget) : target(ioTarget) {}
+
+    void SetHostMemoryMap(const HostMemoryMap<XLEN_t>* hostMemoryMap) {
+        map = hostMemoryMap;
+    }
+
+    virtual Transaction<XLEN_t> Read(XLEN_t startAddress, XLEN_t size, char* buf) override {
+        char* host = map != nullptr ? map->Find(startAddress, size) : nullptr;
+        if (host != nullptr) [[ likely ]] {
+            memcpy(buf, host, size);
+            return { RISCV::TrapCause::NONE, size };
+        }
+        return { RISCV::TrapCause::NONE, target->Read<XLEN_t>(startAddress, size, buf) };
+    }
+
+    virtual Transaction<XLEN_t> Write(XLEN_t startAddress, XLEN_t size, char* buf) override {
+        char* host = map != nullptr ? map->Find(startAddress, size) : nullptr;
+        if (host != nullptr) [[ likely ]] {
+            memcpy(host, buf, size);
+            return { RISCV::TrapCause::NONE, size };
+        }
+        return { RISCV::TrapCause::NONE, target->Write<XLEN_t>(startAddress, size, buf) };
+    }
+
+    virtual Transaction<XLEN_t> Fetch(XLEN_t startAddress, XLEN_t size, char* buf) override {
+        char* host = map != nullptr ? map->Find(startAddress, size) : nullptr;
+        if (host != nullptr) [[ likely ]] {
+            memcpy(buf, host, size);
+            return { RISCV::TrapCause::NONE, size };
+        }
+        return { RISCV::TrapCause::NONE, target->Fetch<XLEN_t>(startAddress, size, buf) };
+    }
+};
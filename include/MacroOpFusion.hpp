@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include <Decoder.hpp>
+#include <EffectiveXlen.hpp>
+#include <HartState.hpp>
+#include <RiscV.hpp>
+#include <Transactor.hpp>
+
+// Pairs of 32-bit instructions that compilers emit back to back, run as one
+// handler. A fused pair takes a single icache entry at the first instruction's
+// pc, with a packed encoding in place of the real ones:
+//
+//   lui rd, hi;   addi/addiw rd, rd, lo   encoding = hi << 12 | lo
+//   auipc rd, hi; addi rd, rd, lo         encoding = hi << 12 | lo
+//   auipc rd, hi; jalr rd/x0, lo(rd)      encoding = hi << 12 | lo
+//   auipc rd, hi; lX rd, lo(rd)           encoding = hi << 12 | lo
+//   slli rd, rs, a; srli/srai rd, rd, b   encoding = b << 11 | a << 5 | rs
+//
+// Handlers are instantiated per destination register, so none of them has to
+// decode a register field. They compute at the hart's full XLEN, so nothing is
+// fused in a mode running at a narrower one (e.g. UXL=32 on RV64). Only the
+// load can trap, and it does so with the auipc retired and pc on the load,
+// just as if the pair had run separately.
+template<typename XLEN_t, typename TransactorT>
+class MacroOpFusion final {
+
+public:
+
+    struct Fused {
+        DecodedInstruction<XLEN_t> handler = nullptr;
+        __uint32_t encoding = 0;
+    };
+
+    // The fused form of first, at pc, followed by second; no handler if they
+    // don't fuse.
+    static Fused Fuse(XLEN_t pc, __uint32_t first, __uint32_t second, HartState<XLEN_t>* state) {
+        if (EffectiveXlen(state) != (sizeof(XLEN_t) == 4 ? RISCV::XlenMode::XL32 : RISCV::XlenMode::XL64)) {
+            return {};
+        }
+        unsigned int rd = (first >> 7) & 0b11111;
+        if (rd == 0 || (second & 0b11) != 0b11) {
+            return {};
+        }
+        unsigned int rd2 = (second >> 7) & 0b11111;
+        unsigned int rs1 = (second >> 15) & 0b11111;
+        unsigned int funct3 = (second >> 12) & 0b111;
+        unsigned int opcode2 = second & 0b1111111;
+        __uint32_t upperLower = (first & 0xfffff000) | (second >> 20);
+        switch (first & 0b1111111) {
+        case 0b0110111: // LUI
+            if (rd2 != rd || rs1 != rd || funct3 != 0b000) {
+                return {};
+            }
+            if (opcode2 == 0b0010011) {
+                return { Handler<LuiAddi>(rd), upperLower };
+            }
+            if (opcode2 == 0b0011011 && sizeof(XLEN_t) == 8) {
+                return { Handler<LuiAddiw>(rd), upperLower };
+            }
+            return {};
+        case 0b0010111: // AUIPC
+            if (rs1 != rd) {
+                return {};
+            }
+            if (opcode2 == 0b0010011 && funct3 == 0b000 && rd2 == rd) {
+                return { Handler<AuipcAddi>(rd), upperLower };
+            }
+            if (opcode2 == 0b1100111 && funct3 == 0b000 && (rd2 == rd || rd2 == 0)) {
+                // The target is fixed, so a misaligned one is caught here
+                // rather than in the handler.
+                XLEN_t target = (pc + Upper(upperLower) + Lower(upperLower)) & ~(XLEN_t)1;
+                if ((target & 0b10) && !(state->misa.extensions & (1 << ('C' - 'A')))) {
+                    return {};
+                }
+                return { rd2 == 0 ? Handler<AuipcJr>(rd) : Handler<AuipcJalrLink>(rd), upperLower };
+            }
+            if (opcode2 == 0b0000011 && rd2 == rd) {
+                switch (funct3) {
+                case 0b000: return { Handler<AuipcLb>(rd), upperLower };
+                case 0b001: return { Handler<AuipcLh>(rd), upperLower };
+                case 0b010: return { Handler<AuipcLw>(rd), upperLower };
+                case 0b100: return { Handler<AuipcLbu>(rd), upperLower };
+                case 0b101: return { Handler<AuipcLhu>(rd), upperLower };
+                }
+                if constexpr (sizeof(XLEN_t) == 8) {
+                    if (funct3 == 0b011) {
+                        return { Handler<AuipcLd>(rd), upperLower };
+                    }
+                    if (funct3 == 0b110) {
+                        return { Handler<AuipcLwu>(rd), upperLower };
+                    }
+                }
+            }
+            return {};
+        case 0b0010011: { // OP-IMM
+            // Shift amounts at or beyond XLEN are illegal in RV32.
+            constexpr __uint32_t shamtMask = sizeof(XLEN_t) == 8 ? 0xfc00707f : 0xfe00707f;
+            if ((first & shamtMask) != 0x00001013 || rd2 != rd || rs1 != rd) {
+                return {};
+            }
+            __uint32_t shifts = (((second >> 20) & 0b111111) << 11) | (((first >> 20) & 0b111111) << 5) | ((first >> 15) & 0b11111);
+            if ((second & shamtMask) == 0x00005013) {
+                return { Handler<SlliSrli>(rd), shifts };
+            }
+            if ((second & shamtMask) == 0x40005013) {
+                return { Handler<SlliSrai>(rd), shifts };
+            }
+            return {};
+        }
+        default:
+            return {};
+        }
+    }
+
+private:
+
+    static inline XLEN_t Upper(__uint32_t encoding) {
+        return (XLEN_t)(__int64_t)(__int32_t)(encoding & 0xfffff000);
+    }
+
+    static inline XLEN_t Lower(__uint32_t encoding) {
+        return (XLEN_t)(__int64_t)((__int32_t)(encoding << 20) >> 20);
+    }
+
+    template<unsigned int rd>
+    struct LuiAddi {
+        static void Execute(__uint32_t encoding, HartState<XLEN_t>* state, Transactor<XLEN_t>* transactor) {
+            state->regs[rd] = Upper(encoding) + Lower(encoding);
+            state->pc += 8;
+        }
+    };
+
+    template<unsigned int rd>
+    struct LuiAddiw {
+        static void Execute(__uint32_t encoding, HartState<XLEN_t>* state, Transactor<XLEN_t>* transactor) {
+            state->regs[rd] = (XLEN_t)(__int64_t)(__int32_t)(Upper(encoding) + Lower(encoding));
+            state->pc += 8;
+        }
+    };
+
+    template<unsigned int rd>
+    struct AuipcAddi {
+        static void Execute(__uint32_t encoding, HartState<XLEN_t>* state, Transactor<XLEN_t>* transactor) {
+            state->regs[rd] = state->pc + Upper(encoding) + Lower(encoding);
+            state->pc += 8;
+        }
+    };
+
+    template<unsigned int rd, bool link>
+    struct AuipcJalr {
+        static void Execute(__uint32_t encoding, HartState<XLEN_t>* state, Transactor<XLEN_t>* transactor) {
+            XLEN_t upper = state->pc + Upper(encoding);
+            state->regs[rd] = link ? state->pc + 8 : upper;
+            state->pc = (upper + Lower(encoding)) & ~(XLEN_t)1;
+        }
+    };
+
+    template<unsigned int rd, typename T>
+    struct AuipcLoad {
+        static void Execute(__uint32_t encoding, HartState<XLEN_t>* state, Transactor<XLEN_t>* transactor) {
+            state->regs[rd] = state->pc + Upper(encoding);
+            state->pc += 4;
+            XLEN_t address = state->regs[rd] + Lower(encoding);
+            T value;
+            Transaction<XLEN_t> transaction = static_cast<TransactorT*>(transactor)->Load(address, &value);
+            if (transaction.trapCause != RISCV::TrapCause::NONE) [[ unlikely ]] {
+                state->RaiseException(transaction.trapCause, address);
+                return;
+            }
+            state->regs[rd] = (XLEN_t)(std::make_signed_t<XLEN_t>)value;
+            state->pc += 4;
+        }
+    };
+
+    template<unsigned int rd, bool arithmetic>
+    struct SlliSrx {
+        static void Execute(__uint32_t encoding, HartState<XLEN_t>* state, Transactor<XLEN_t>* transactor) {
+            XLEN_t shifted = state->regs[encoding & 0b11111] << ((encoding >> 5) & 0b111111);
+            unsigned int right = encoding >> 11;
+            state->regs[rd] = arithmetic ? (XLEN_t)((std::make_signed_t<XLEN_t>)shifted >> right) : shifted >> right;
+            state->pc += 8;
+        }
+    };
+
+    template<unsigned int rd> using AuipcJr = AuipcJalr<rd, false>;
+    template<unsigned int rd> using AuipcJalrLink = AuipcJalr<rd, true>;
+    template<unsigned int rd> using AuipcLb = AuipcLoad<rd, __int8_t>;
+    template<unsigned int rd> using AuipcLh = AuipcLoad<rd, __int16_t>;
+    template<unsigned int rd> using AuipcLw = AuipcLoad<rd, __int32_t>;
+    template<unsigned int rd> using AuipcLd = AuipcLoad<rd, __int64_t>;
+    template<unsigned int rd> using AuipcLbu = AuipcLoad<rd, __uint8_t>;
+    template<unsigned int rd> using AuipcLhu = AuipcLoad<rd, __uint16_t>;
+    template<unsigned int rd> using AuipcLwu = AuipcLoad<rd, __uint32_t>;
+    template<unsigned int rd> using SlliSrli = SlliSrx<rd, false>;
+    template<unsigned int rd> using SlliSrai = SlliSrx<rd, true>;
+
+    using Handlers = std::array<DecodedInstruction<XLEN_t>, 32>;
+
+    template<template<unsigned int> class Op, unsigned int... rd>
+    static constexpr Handlers ForEachRegister(std::integer_sequence<unsigned int, rd...>) {
+        return { &Op<rd>::Execute... };
+    }
+
+    template<template<unsigned int> class Op>
+    static inline DecodedInstruction<XLEN_t> Handler(unsigned int rd) {
+        static constexpr Handlers handlers = ForEachRegister<Op>(std::make_integer_sequence<unsigned int, 32>());
+        return handlers[rd];
+    }
+
+};
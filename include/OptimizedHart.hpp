@@ -2,83 +2,1083 @@
 
 #include <type_traits>
 #include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 #include <Hart.hpp>
+#include <ControlFlow.hpp>
 #include <Decoders/PrecomputedDecoder.hpp>
+#include <MacroOpFusion.hpp>
+#include <SharedCodeCache.hpp>
 #include <Transactors/VirtToHostTransactor.hpp>
 
-// TODO accelerated WFI states?
-template<typename XLEN_t>
+template<typename XLEN_t, bool blockExecution = false>
 class OptimizedHart final : public Hart<XLEN_t> {
 
 private:
 
     static constexpr unsigned int icacheBits = 14;
     static constexpr unsigned int virtHostCacheBits = 8;
+    static constexpr unsigned int blockCacheBits = 10;
+    static constexpr unsigned int maxBlockInstructions = 32;
+    static constexpr __uint32_t wfiEncoding = 0x10500073;
+
+    using VirtToHost = VirtToHostTransactor<XLEN_t, virtHostCacheBits>;
 
     PrecomputedDecoder<XLEN_t> decoder;
-    VirtToHostTransactor<XLEN_t, virtHostCacheBits> transactor;
-    // TODO turn on bufferTransactions later on.
+    VirtToHost transactor;
 
+    // Entries are tagged with a context of (generation << 18 | privilege
+    // mode << 16 | ASID), so switching address spaces or modes doesn't need a
+    // flush and invalidating the whole icache is a generation bump.
+    // Instructions are at least 2-byte aligned, so an odd full_pc marks a
+    // single entry as empty. An entry is 8 bytes long when it holds a fused
+    // pair of instructions, and flow says whether leaving pc anywhere but
+    // after it means it trapped.
     struct SimplyCachedInstruction {
-        XLEN_t full_pc;
+        XLEN_t full_pc = 1;
         __uint32_t encoding = 0;
+        __uint32_t context = 0;
+        __uint8_t length = 0;
+        ControlFlow flow = ControlFlow::FallsThrough;
         DecodedInstruction<XLEN_t> instruction = nullptr;
     };
     SimplyCachedInstruction icache[1<<icacheBits];
+    static constexpr __uint16_t icacheGenerations = 1 << 14;
+    __uint16_t icacheGeneration = 1;
+    __uint64_t icacheSuperpageMark = 0;
+    bool watchCode = false;
+    bool fuseInstructions = true;
+
+    // Where icache misses get decoded code from, when attached, and the pages
+    // of it this hart used last, so moving between a few pages of code (e.g.
+    // a caller and its callee) doesn't go back to the shared tables.
+    SharedCodeCache<XLEN_t>* codeCache = nullptr;
+    static constexpr unsigned int codePageSlots = 8;
+    struct CodePage {
+        const char* host = nullptr;
+        __uint64_t configuration = 0;
+        std::shared_ptr<typename SharedCodeCache<XLEN_t>::Page> page;
+    };
+    CodePage codePages[codePageSlots];
+
+    // What the decoder was last configured for. Privilege only changes on a
+    // trap or xRET, and mstatus.SXL/UXL only matter once one happens, so
+    // these are rechecked whenever control flow doesn't fall through.
+    RISCV::PrivilegeMode decodedPrivilege;
+    __uint32_t decodedXlens = 0;
+
+    // A straight-line run of pre-decoded instructions that ends at the first
+    // control transfer, system instruction, fence, or page boundary. Blocks
+    // live in a direct-mapped array, so successor links are plain pointers
+    // that get revalidated against startPC and generation before following.
+    struct CachedBlock {
+        XLEN_t startPC;
+        XLEN_t endPC;
+        __uint32_t mode;
+        __uint64_t generation = 0;
+        unsigned int length = 0;
+        bool serialized = false;
+        bool endsInWFI = false;
+        CachedBlock* fallthrough = nullptr;
+        CachedBlock* taken = nullptr;
+        struct { __uint32_t encoding; ControlFlow flow; DecodedInstruction<XLEN_t> instruction; } ops[maxBlockInstructions];
+    };
+    std::conditional_t<blockExecution, CachedBlock[1<<blockCacheBits], char> blocks;
+    __uint64_t blockGeneration = 1;
+
+    // The SFENCE.VMA being executed, set just around its dispatch, since the
+    // fence callback doesn't carry its operands. SFENCE.VMA is never cached
+    // alongside other instructions, so nothing else has to set it.
+    __uint32_t runningVMFence = 0;
+
+    // Set when running alongside other harts on shared memory.
+    std::mutex* atomicsLock = nullptr;
+    std::function<void(HartCallbackArgument)> fenceBroadcast;
+    std::atomic<unsigned int> pendingFences = 0;
+    struct { bool valid = false; XLEN_t address; __int64_t value; } reservation;
+
+    // Set when a WFI retired with no enabled interrupt pending.
+    bool waitingForInterrupt = false;
+
+    // Whether the hart was parked in WFI with no enabled interrupt pending
+    // when its last Tick() returned, for other threads to read.
+    std::atomic<bool> parked = false;
+
+    unsigned int exitEvents = 0;
+    std::atomic<bool> stopRequested = false;
+    // The enabled interrupts pending when last checked, so ExitOnInterrupt
+    // only fires when one is added, not for one the guest is masking.
+    XLEN_t knownInterrupts = 0;
+
+    // Where Reset() returns to, when set.
+    std::unique_ptr<HartSnapshot<XLEN_t>> resetBaseline;
+
+    // Snapshots carry the icache and translation caches along, so a restored
+    // hart starts out warm.
+    struct WarmCaches final : public HartSnapshotExtra {
+        SimplyCachedInstruction icache[1<<icacheBits];
+        __uint16_t icacheGeneration;
+        typename VirtToHost::Caches transactor;
+        bool waitingForInterrupt;
+        // What the icache was filled for; see ICacheConfiguration().
+        unsigned int icacheConfiguration;
+    };
 
 public:
 
+    // Events that end a Tick() early, after the instruction that caused them.
+    enum ExitEvent : unsigned int {
+        ExitOnTrap = 1 << 0,
+        ExitOnUncachedAccess = 1 << 1, // e.g. MMIO, which a device may need to see promptly
+        ExitOnInterrupt = 1 << 2,      // an enabled interrupt newly pending, checked at each jump or trap
+    };
+
+    // The most instructions one Tick() will run. Longer quanta run compute
+    // bound guests faster; shorter ones let devices respond sooner.
+    unsigned int quantum = 10000;
+
     OptimizedHart(CASK::IOTarget* bus, __uint32_t maximalExtensions) :
         Hart<XLEN_t>(maximalExtensions),
         decoder(&this->state),
         transactor(bus, &this->state) {
         this->state.implCallback = std::bind(&OptimizedHart::Callback, this, std::placeholders::_1);
-        // TODO callback for changing XLENs
         Reset();
     };
 
     virtual inline unsigned int Tick() override {
-        for (unsigned int i = 0; i < 10000; i++) {
+        unsigned int executed = TickQuantum();
+        parked.store(waitingForInterrupt && !InterruptPending(), std::memory_order_release);
+        return executed;
+    };
+
+    virtual inline void Reset() override {
+        if (resetBaseline != nullptr) {
+            Hart<XLEN_t>::Restore(*resetBaseline);
+            transactor.RollBackWrites();
+            if (codeCache != nullptr) {
+                codeCache->Revalidate();
+            }
+        } else {
+            this->state.Reset(this->resetVector);
+            transactor.Clear();
+        }
+        waitingForInterrupt = false;
+        parked.store(false, std::memory_order_release);
+        reservation.valid = false;
+        ConfigureDecoder();
+        InvalidateICache();
+        blockGeneration++;
+    };
+
+    virtual inline Transactor<XLEN_t>* getVATransactor() override {
+        return &this->transactor;
+    }
+
+    virtual void AttachHostMemory(const HostMemoryMap<XLEN_t>* map) override {
+        transactor.SetHostMemoryMap(map);
+        InvalidateICache();
+        blockGeneration++;
+    }
+
+    virtual void AttachTrace(TraceRecorder* recorder) override {
+        this->trace = recorder;
+        transactor.trace = recorder;
+        // Traces record fused pairs' instructions separately.
+        InvalidateICache();
+    }
+
+    virtual SegmentsTransaction<XLEN_t> ReadSegments(const TransferSegment<XLEN_t>* segments, size_t count) override {
+        return transactor.template TransactSegments<IOVerb::Read>(segments, count);
+    }
+
+    virtual SegmentsTransaction<XLEN_t> WriteSegments(const TransferSegment<XLEN_t>* segments, size_t count) override {
+        return transactor.template TransactSegments<IOVerb::Write>(segments, count);
+    }
+
+    virtual HartSnapshot<XLEN_t> Snapshot() override {
+        std::shared_ptr<WarmCaches> caches = std::make_shared<WarmCaches>();
+        std::copy(std::begin(icache), std::end(icache), caches->icache);
+        caches->icacheGeneration = icacheGeneration;
+        transactor.SaveCaches(&caches->transactor);
+        caches->waitingForInterrupt = waitingForInterrupt;
+        caches->icacheConfiguration = ICacheConfiguration();
+        return { this->state, this->resetVector, caches };
+    }
+
+    virtual void Restore(const HartSnapshot<XLEN_t>& snapshot) override {
+        Hart<XLEN_t>::Restore(snapshot);
+        ConfigureDecoder();
+        parked.store(false, std::memory_order_release);
+        reservation.valid = false;
+        blockGeneration++;
+        const WarmCaches* caches = dynamic_cast<const WarmCaches*>(snapshot.extra.get());
+        if (caches == nullptr) {
+            waitingForInterrupt = false;
+            transactor.Clear();
+            InvalidateICache();
+            return;
+        }
+        std::copy(std::begin(caches->icache), std::end(caches->icache), icache);
+        icacheGeneration = caches->icacheGeneration;
+        transactor.RestoreCaches(&caches->transactor);
+        // Restored lines may have been fetched through a superpage.
+        icacheSuperpageMark = transactor.FetchSuperpageFills() - 1;
+        waitingForInterrupt = caches->waitingForInterrupt;
+        if (watchCode) {
+            // None of the restored lines are being watched.
+            InvalidateICache();
+        } else if (caches->icacheConfiguration != ICacheConfiguration()) {
+            // e.g. atomics cached for plain execution before AttachSMP(), or
+            // fused pairs before AttachTrace().
+            InvalidateICache();
+        }
+    }
+
+    virtual inline PerfCounters getPerfCounters() override {
+        PerfCounters counters = this->perf;
+        counters += transactor.perf;
+        counters += decoder.perf;
+        return counters;
+    }
+
+    // Run alongside other harts that share this hart's memory. Guest atomics
+    // become host atomics on the backing memory (LR/SC as a compare-exchange
+    // against the value LR saw). Only atomics on memory that isn't host
+    // memory (e.g. MMIO) run under lock, with SC comparing against the value
+    // LR saw there too. Local fences are handed to broadcast so the other
+    // harts can be told to flush.
+    void AttachSMP(std::mutex* lock, std::function<void(HartCallbackArgument)> broadcast) {
+        atomicsLock = lock;
+        fenceBroadcast = broadcast;
+        reservation.valid = false;
+        // Atomics decoded before now were cached for plain execution.
+        InvalidateICache();
+        blockGeneration++;
+    }
+
+    // Watch stores to code this hart has decoded, and invalidate just the
+    // affected lines when one lands, so guests that modify code without a
+    // FENCE.I still see their changes. Costs a slow-path store for every
+    // write to a page holding cached code.
+    void DetectSelfModifyingCode(bool enable) {
+        watchCode = enable;
+        transactor.UnwatchAll();
+        if (enable) {
+            transactor.codeWriteHook = std::bind(&OptimizedHart::CodeWritten, this, std::placeholders::_1, std::placeholders::_2);
+        } else {
+            transactor.codeWriteHook = nullptr;
+        }
+        // Anything decoded before now isn't being watched.
+        InvalidateICache();
+        blockGeneration++;
+    }
+
+    // Cache common pairs of instructions (see MacroOpFusion.hpp) as single
+    // icache entries. On by default; pairs aren't fused while tracing.
+    void FuseInstructions(bool enable) {
+        fuseInstructions = enable;
+        InvalidateICache();
+    }
+
+    // Fill the icache from decoded pages shared with other harts, rather than
+    // fetching and decoding each instruction, or stop with nullptr. Every
+    // hart sharing cache must be attached to it, so their FENCE.Is reach it.
+    // Only code in the attached HostMemoryMap is shared.
+    void AttachCodeCache(SharedCodeCache<XLEN_t>* cache) {
+        codeCache = cache;
+        for (CodePage& slot : codePages) {
+            slot = {};
+        }
+        InvalidateICache();
+    }
+
+    // True while parked in WFI with no enabled interrupt pending. Tick() then
+    // returns a full quantum without executing anything, so the platform can
+    // skip ahead to its next timer or device event.
+    bool IsWaitingForInterrupt() {
+        return waitingForInterrupt && !InterruptPending();
+    }
+
+    // The same, as of the end of the last Tick(), and safe to call from
+    // threads other than the one ticking the hart.
+    bool IsParked() {
+        return parked.load(std::memory_order_acquire);
+    }
+
+    // Make Reset() go back to the hart's current state, and to the current
+    // contents of any memory in the attached HostMemoryMap that it stores
+    // to, rather than to the reset vector. Only the 4K granules stored to
+    // since are copied back, so for short runs (e.g. fuzzing) a reset costs
+    // about as much as the run touched. Stores from other harts, devices or
+    // page table A/D updates aren't rolled back.
+    void SetResetBaseline() {
+        resetBaseline = std::make_unique<HartSnapshot<XLEN_t>>(Hart<XLEN_t>::Snapshot());
+        transactor.LogWrites(true);
+    }
+
+    void ClearResetBaseline() {
+        resetBaseline.reset();
+        transactor.LogWrites(false);
+    }
+
+    // Choose which ExitEvents end a Tick() early. None do by default.
+    void SetExitEvents(unsigned int events) {
+        exitEvents = events;
+        transactor.uncachedAccessSignal = (events & ExitOnUncachedAccess) ? &stopRequested : nullptr;
+    }
+
+    // Safe to call from any thread. The running Tick(), or else the next one,
+    // returns after its current instruction.
+    void RequestStop() {
+        stopRequested.store(true, std::memory_order_relaxed);
+    }
+
+    // Safe to call from any thread; takes effect at the start of the next Tick().
+    void RemoteFence(HartCallbackArgument arg) {
+        unsigned int bits = arg == HartCallbackArgument::RequestedVMfence ? 0b11 : 0b01;
+        pendingFences.fetch_or(bits, std::memory_order_relaxed);
+    }
+
+private:
+
+    inline unsigned int TickQuantum() {
+        if (pendingFences.load(std::memory_order_relaxed) != 0) [[ unlikely ]] {
+            ApplyRemoteFences();
+        }
+        // The platform may have delivered an interrupt since the last Tick().
+        CheckMode();
+        knownInterrupts = this->state.mip & this->state.mie;
+        if (waitingForInterrupt) [[ unlikely ]] {
+            // Nothing to do until an interrupt arrives; let the whole quantum
+            // pass without spinning through it.
+            if (!InterruptPending()) {
+                return quantum;
+            }
+            waitingForInterrupt = false;
+        }
+        if (this->profiler == nullptr) [[ likely ]] {
+            return Run(quantum);
+        }
+        return RunProfiled();
+    }
+
+    // Run up to budget instructions, or fewer if something ends the Tick().
+    inline unsigned int Run(unsigned int budget) {
+        if constexpr (blockExecution) {
+            return TickBlocks(budget);
+        }
+        for (unsigned int i = 0; i < budget; i++) {
             SimplyCachedInstruction inst = icache[(this->state.pc >> 1) & ((1<<icacheBits)-1)];
-            if (inst.full_pc == this->state.pc) [[ likely ]] {
+            if (inst.full_pc == this->state.pc && inst.context == ICacheContext()) [[ likely ]] {
+                PERF_COUNT(this->perf.icacheHits);
+                TRACE(RecordInstruction(inst.full_pc, inst.encoding));
+                bool traps = inst.flow == ControlFlow::Checked && WillTrap(inst.encoding, &this->state);
                 inst.instruction(inst.encoding, &this->state, &transactor);
+                // A fused pair retires two instructions.
+                i += inst.length >> 3;
+                if (ExitAfter(inst, traps)) [[ unlikely ]] {
+                    return i + 1;
+                }
                 continue;
             }
+            PERF_COUNT(this->perf.icacheMisses);
             __uint32_t encoding;
-            Transaction<XLEN_t> transaction = transactor.Fetch(this->state.pc, sizeof(encoding), (char*)&encoding);
+            DecodedInstruction<XLEN_t> decoded = nullptr;
+            Transaction<XLEN_t> transaction = { RISCV::TrapCause::NONE, 0 };
+            if (codeCache == nullptr || !FetchShared(this->state.pc, &encoding, &decoded)) {
+                transaction = transactor.FetchInstruction(this->state.pc, &encoding);
+                if (transaction.trapCause == RISCV::TrapCause::NONE) {
+                    decoded = decoder.Decode(encoding);
+                }
+            }
             if (transaction.trapCause == RISCV::TrapCause::NONE) {
-                DecodedInstruction<XLEN_t> decoded = decoder.Decode(encoding);
-                icache[(this->state.pc >> 1) & ((1<<icacheBits)-1)] = { this->state.pc, encoding, decoded };
-                decoded(encoding, &this->state, &transactor);
+                TRACE(RecordInstruction(this->state.pc, encoding));
+                if ((atomicsLock != nullptr && IsAtomic(encoding)) || IsVMFence(encoding)) [[ unlikely ]] {
+                    SimplyCachedInstruction serialized = { this->state.pc, encoding, 0, 4, ControlFlow::FallsThrough, decoded };
+                    ExecuteSerialized(encoding, decoded);
+                    if (ExitAfter(serialized, false)) {
+                        return i + 1;
+                    }
+                    continue;
+                }
+                // WFI is never cached, so the hit path doesn't need to look for it.
+                if (encoding == wfiEncoding) [[ unlikely ]] {
+                    SimplyCachedInstruction wfi = { this->state.pc, encoding, 0, 4, ControlFlow::FallsThrough, decoded };
+                    decoded(encoding, &this->state, &transactor);
+                    // A WFI that trapped (e.g. with mstatus.TW set) doesn't wait.
+                    if (this->state.pc == wfi.full_pc + 4 && !InterruptPending()) {
+                        waitingForInterrupt = true;
+                        return i + 1;
+                    }
+                    if (ExitAfter(wfi, false)) {
+                        return i + 1;
+                    }
+                    continue;
+                }
+                if ((inst.full_pc & 1) == 0 && inst.context >> 18 == icacheGeneration) {
+                    PERF_COUNT(this->perf.icacheEvictions);
+                }
+                XLEN_t pc = this->state.pc;
+                SimplyCachedInstruction fill = {
+                    pc, encoding, ICacheContext(), InstructionLength(encoding), ClassifyControlFlow(encoding, &this->state), decoded
+                };
+                if (fuseInstructions && this->trace == nullptr) {
+                    Fuse(&fill);
+                }
+                icache[(pc >> 1) & ((1<<icacheBits)-1)] = fill;
+                if (watchCode) {
+                    transactor.WatchFetch(pc, fill.length == 8 ? 8 : sizeof(encoding));
+                }
+                bool traps = fill.flow == ControlFlow::Checked && WillTrap(fill.encoding, &this->state);
+                fill.instruction(fill.encoding, &this->state, &transactor);
+                i += fill.length >> 3;
+                if (ExitAfter(fill, traps)) [[ unlikely ]] {
+                    return i + 1;
+                }
             } else {
+                PERF_COUNT(this->perf.traps);
+                TRACE(RecordTrap(this->state.pc));
                 this->state.RaiseException(transaction.trapCause, this->state.pc);
+                CheckMode();
+                if ((exitEvents & ExitOnTrap) || StopRequested()) {
+                    return i + 1;
+                }
             }
         }
-        return 10000;
-    };
+        return budget;
+    }
 
-    virtual inline void Reset() override {
-        this->state.Reset(this->resetVector);
-        transactor.Clear();
+    // Run from sample point to sample point, so the loop between them is the
+    // same one that runs without a profiler.
+    inline unsigned int RunProfiled() {
+        unsigned int executed = 0;
+        while (executed < quantum) {
+            unsigned int budget = quantum - executed;
+            if (budget > this->profiler->UntilSample()) {
+                budget = this->profiler->UntilSample();
+            }
+            unsigned int ran = Run(budget);
+            executed += ran;
+            this->profiler->Advance(ran, &this->state, [this](XLEN_t address, XLEN_t* value) {
+                return transactor.Peek(address, sizeof(XLEN_t), (char*)value);
+            });
+            if (ran < budget || waitingForInterrupt) {
+                break;
+            }
+        }
+        return executed;
+    }
+
+    inline unsigned int TickBlocks(unsigned int budget) {
+        unsigned int executed = 0;
+        CachedBlock* block = nullptr;
+        while (executed < budget) {
+            if (block == nullptr) [[ unlikely ]] {
+                block = LookupBlock(this->state.pc);
+                if (block == nullptr) {
+                    // Fetch faulted on the block entry; the trap has been raised.
+                    executed++;
+                    if ((exitEvents & ExitOnTrap) || StopRequested()) {
+                        return executed;
+                    }
+                    continue;
+                }
+            }
+            if (block->serialized) [[ unlikely ]] {
+                TRACE(RecordInstruction(block->startPC, block->ops[0].encoding));
+                ExecuteSerialized(block->ops[0].encoding, block->ops[0].instruction);
+                executed++;
+                // Neither an atomic nor SFENCE.VMA redirects unless it traps.
+                if (this->state.pc != block->endPC && ExitAfterRedirect(block->startPC, true)) [[ unlikely ]] {
+                    return executed;
+                }
+                if (StopRequested()) [[ unlikely ]] {
+                    return executed;
+                }
+                block = Chain(block);
+                continue;
+            }
+            XLEN_t pc = block->startPC;
+            unsigned int k = 0;
+            // A block longer than what's left of the budget stops part way,
+            // and the next Tick() picks up from a block starting there.
+            unsigned int length = budget - executed < block->length ? budget - executed : block->length;
+            while (k < length) {
+                XLEN_t next = pc + ((block->ops[k].encoding & 0b11) == 0b11 ? 4 : 2);
+                TRACE(RecordInstruction(pc, block->ops[k].encoding));
+                ControlFlow flow = block->ops[k].flow;
+                bool traps = flow == ControlFlow::Checked && WillTrap(block->ops[k].encoding, &this->state);
+                block->ops[k].instruction(block->ops[k].encoding, &this->state, &transactor);
+                k++;
+                if (this->state.pc != next) [[ unlikely ]] {
+                    if (ExitAfterRedirect(pc, flow == ControlFlow::FallsThrough || traps)) {
+                        return executed + k;
+                    }
+                    break;
+                }
+                pc = next;
+                // A store that rewrote decoded code leaves the rest of this
+                // block stale; carry on from a block built afresh.
+                if (block->generation != blockGeneration) [[ unlikely ]] {
+                    break;
+                }
+            }
+            executed += k;
+            // Only a WFI that retired, rather than trapped, waits.
+            if (block->endsInWFI && this->state.pc == block->endPC && !InterruptPending()) [[ unlikely ]] {
+                waitingForInterrupt = true;
+                return executed;
+            }
+            if (StopRequested() || executed == budget) [[ unlikely ]] {
+                return executed;
+            }
+            block = Chain(block);
+        }
+        return executed;
+    }
+
+    // Follow (or patch) the link out of the block that just ran.
+    inline CachedBlock* Chain(CachedBlock* from) {
+        CachedBlock** link = this->state.pc == from->endPC ? &from->fallthrough : &from->taken;
+        CachedBlock* next = *link;
+        if (next != nullptr && next->startPC == this->state.pc && next->generation == blockGeneration &&
+            next->mode == CurrentMode()) [[ likely ]] {
+            PERF_COUNT(this->perf.blockChains);
+            return next;
+        }
+        next = LookupBlock(this->state.pc);
+        *link = next;
+        return next;
+    }
+
+    inline CachedBlock* LookupBlock(XLEN_t pc) {
+        PERF_COUNT(this->perf.blockLookups);
+        CachedBlock* block = &blocks[(pc >> 1) & ((1<<blockCacheBits)-1)];
+        if (block->startPC == pc && block->generation == blockGeneration && block->mode == CurrentMode()) [[ likely ]] {
+            return block;
+        }
+        return BuildBlock(block, pc);
+    }
+
+    inline CachedBlock* BuildBlock(CachedBlock* block, XLEN_t pc) {
+        PERF_COUNT(this->perf.blockBuilds);
+        block->generation = 0;
+        block->length = 0;
+        block->fallthrough = nullptr;
+        block->taken = nullptr;
+        block->serialized = false;
+        block->endsInWFI = false;
+        block->startPC = pc;
+        block->mode = CurrentMode();
+        XLEN_t fetchPC = pc;
+        while (block->length < maxBlockInstructions) {
+            // Don't read ahead across a page; the next page may not be mapped.
+            if (block->length != 0 && (fetchPC & 0xfff) > 0xffc) {
+                break;
+            }
+            __uint32_t encoding;
+            Transaction<XLEN_t> transaction = transactor.FetchInstruction(fetchPC, &encoding);
+            if (transaction.trapCause != RISCV::TrapCause::NONE) {
+                if (block->length == 0) {
+                    PERF_COUNT(this->perf.traps);
+                    TRACE(RecordTrap(pc));
+                    this->state.RaiseException(transaction.trapCause, pc);
+                    CheckMode();
+                    return nullptr;
+                }
+                break;
+            }
+            if ((atomicsLock != nullptr && IsAtomic(encoding)) || IsVMFence(encoding)) {
+                // Atomics and SFENCE.VMA run alone in their own block, outside
+                // the plain loop.
+                if (block->length == 0) {
+                    block->ops[block->length++] = { encoding, ControlFlow::FallsThrough, decoder.Decode(encoding) };
+                    block->serialized = true;
+                    fetchPC += 4;
+                }
+                break;
+            }
+            block->ops[block->length++] = { encoding, ClassifyControlFlow(encoding, &this->state), decoder.Decode(encoding) };
+            fetchPC += (encoding & 0b11) == 0b11 ? 4 : 2;
+            if (EndsBlock(encoding)) {
+                block->endsInWFI = encoding == wfiEncoding;
+                break;
+            }
+        }
+        block->endPC = fetchPC;
+        block->generation = blockGeneration;
+        if (watchCode) {
+            transactor.WatchFetch(pc, fetchPC - pc);
+        }
+        return block;
+    }
+
+    // Look the instruction at pc up in the shared code cache, through the
+    // fetch translation cache. False if it isn't there to be had: a fault,
+    // code outside the host memory map (pages are read whole, so they must
+    // be known to lie in one run of host memory), or an instruction running
+    // off its page, all of which take the ordinary fetch path instead.
+    inline bool FetchShared(XLEN_t pc, __uint32_t* encoding, DecodedInstruction<XLEN_t>* decoded) {
+        RISCV::TrapCause trap;
+        char* host = transactor.template Resolve<IOVerb::Fetch>(pc, &trap);
+        if (host == nullptr) {
+            return false;
+        }
+        const char* hostPage = host - (pc & 0xfff);
+        __uint64_t configuration = ((__uint64_t)this->state.misa.extensions << 8) | (__uint64_t)EffectiveXlen(&this->state);
+        CodePage& cached = codePages[((std::uintptr_t)hostPage >> 12) % codePageSlots];
+        if (hostPage != cached.host || configuration != cached.configuration || !codeCache->IsCurrent(cached.page.get())) [[ unlikely ]] {
+            if (!transactor.IsHostGranule(hostPage)) {
+                return false;
+            }
+            cached = { hostPage, configuration, codeCache->Lookup(hostPage, configuration, &decoder) };
+        }
+        unsigned int slot = (pc & 0xfff) >> 1;
+        if (cached.page->handlers[slot] == nullptr) {
+            return false;
+        }
+        *encoding = cached.page->encodings[slot];
+        *decoded = cached.page->handlers[slot];
+        return true;
+    }
+
+    static inline __uint8_t InstructionLength(__uint32_t encoding) {
+        return (encoding & 0b11) == 0b11 ? 4 : 2;
+    }
+
+    // Replace a fresh icache entry with a fused one if its instruction pairs
+    // up with the next. The next instruction is only looked at on the same
+    // page, so fusing never faults or translates anything new.
+    inline void Fuse(SimplyCachedInstruction* entry) {
+        if (entry->length != 4 || (entry->full_pc & 0xfff) > 0xff8) {
+            return;
+        }
+        __uint32_t next;
+        if (transactor.FetchInstruction(entry->full_pc + 4, &next).trapCause != RISCV::TrapCause::NONE) {
+            return;
+        }
+        typename MacroOpFusion<XLEN_t, VirtToHost>::Fused fused =
+            MacroOpFusion<XLEN_t, VirtToHost>::Fuse(entry->full_pc, entry->encoding, next, &this->state);
+        if (fused.handler != nullptr) {
+            entry->encoding = fused.encoding;
+            entry->instruction = fused.handler;
+            entry->length = 8;
+            // Fused jumps have their targets checked up front, so only a
+            // fused load can trap.
+            entry->flow = (next & 0b1111111) == 0b1100111 ? ControlFlow::Jumps : ControlFlow::FallsThrough;
+        }
+    }
+
+    static inline bool EndsBlock(__uint32_t encoding) {
+        if ((encoding & 0b11) != 0b11) {
+            __uint32_t quadrant = encoding & 0b11;
+            __uint32_t funct3 = (encoding >> 13) & 0b111;
+            if (quadrant == 0b01) {
+                // c.jal (RV32), c.j, c.beqz, c.bnez
+                return funct3 == 0b001 || funct3 == 0b101 || funct3 == 0b110 || funct3 == 0b111;
+            }
+            if (quadrant == 0b10) {
+                // c.jr, c.jalr, c.ebreak
+                return funct3 == 0b100 && ((encoding >> 2) & 0b11111) == 0;
+            }
+            return false;
+        }
+        switch (encoding & 0b1111111) {
+            case 0b1100011: // BRANCH
+            case 0b1101111: // JAL
+            case 0b1100111: // JALR
+            case 0b1110011: // SYSTEM
+            case 0b0001111: // MISC-MEM
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Called once inst has executed, with whether it was found to be about to
+    // trap; true if Tick() should return after it.
+    inline bool ExitAfter(const SimplyCachedInstruction& inst, bool traps) {
+        if (this->state.pc != inst.full_pc + inst.length) [[ unlikely ]] {
+            // Only the second half of a fused pair can trap.
+            XLEN_t pc = inst.length == 8 ? inst.full_pc + 4 : inst.full_pc;
+            if (ExitAfterRedirect(pc, inst.flow == ControlFlow::FallsThrough || traps)) {
+                return true;
+            }
+        }
+        return StopRequested();
+    }
+
+    // The instruction at pc didn't fall through, and trapped is whether that
+    // was a trap (see ControlFlow.hpp) rather than a jump.
+    inline bool ExitAfterRedirect(XLEN_t pc, bool trapped) {
+        CheckMode();
+        if (trapped) {
+            PERF_COUNT(this->perf.traps);
+            TRACE(RecordTrap(pc));
+        }
+        return ((exitEvents & ExitOnTrap) && trapped) ||
+               ((exitEvents & ExitOnInterrupt) && InterruptRaised());
+    }
+
+    inline bool InterruptRaised() {
+        XLEN_t pending = this->state.mip & this->state.mie;
+        bool raised = (pending & ~knownInterrupts) != 0;
+        knownInterrupts = pending;
+        return raised;
+    }
+
+    inline bool StopRequested() {
+        if (stopRequested.load(std::memory_order_relaxed)) [[ unlikely ]] {
+            stopRequested.store(false, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    // WFI wakes on any locally enabled interrupt, whatever the global enables.
+    inline bool InterruptPending() {
+        return (this->state.mip & this->state.mie) != 0;
+    }
+
+    static inline bool IsAtomic(__uint32_t encoding) {
+        return (encoding & 0b1111111) == 0b0101111;
+    }
+
+    static inline bool IsVMFence(__uint32_t encoding) {
+        return (encoding & 0xfe007fff) == 0x12000073;
+    }
+
+    inline void ExecuteSerialized(__uint32_t encoding, DecodedInstruction<XLEN_t> decoded) {
+        if (IsVMFence(encoding)) {
+            ExecuteVMFence(encoding, decoded);
+            return;
+        }
+        ExecuteAtomic(encoding, decoded);
+    }
+
+    inline void ExecuteVMFence(__uint32_t encoding, DecodedInstruction<XLEN_t> decoded) {
+        runningVMFence = encoding;
+        decoded(encoding, &this->state, &transactor);
+        runningVMFence = 0;
+    }
+
+    inline void ExecuteAtomic(__uint32_t encoding, DecodedInstruction<XLEN_t> decoded) {
+        unsigned int width = (encoding >> 12) & 0b111;
+        if (width == 0b010 && ExecuteAtomic<__int32_t>(encoding)) {
+            return;
+        }
+        if constexpr (sizeof(XLEN_t) >= sizeof(__int64_t)) {
+            if (width == 0b011 && ExecuteAtomic<__int64_t>(encoding)) {
+                return;
+            }
+        }
+        // Misaligned, faulting or reserved encodings.
+        std::lock_guard<std::mutex> guard(*atomicsLock);
+        decoded(encoding, &this->state, &transactor);
+    }
+
+    // Every access to host memory is a host atomic, so harts never mix host
+    // atomics with locked read-modify-writes on the same word. Memory the
+    // transactor can't resolve yet is read once under atomicsLock, which
+    // caches it if it turns out to be host memory; only what still doesn't
+    // resolve (e.g. MMIO) runs under the lock.
+    template<typename T>
+    inline bool ExecuteAtomic(__uint32_t encoding) {
+        unsigned int funct5 = encoding >> 27;
+        unsigned int rs1 = (encoding >> 15) & 0b11111;
+        XLEN_t address = this->state.regs[rs1];
+        if ((address & (sizeof(T) - 1)) || !IsAtomicOperation(funct5)) {
+            return false;
+        }
+        RISCV::TrapCause trap;
+        char* host = ResolveAtomic(funct5, address, &trap);
+        if (host == nullptr && trap == RISCV::TrapCause::NONE) {
+            std::lock_guard<std::mutex> guard(*atomicsLock);
+            T value;
+            Transaction<XLEN_t> transaction = transactor.Load(address, &value);
+            if (transaction.trapCause != RISCV::TrapCause::NONE || transaction.transferredSize != sizeof(T)) {
+                return false;
+            }
+            host = ResolveAtomic(funct5, address, &trap);
+            if (host == nullptr) {
+                ExecuteLockedAtomic<T>(encoding, value);
+                return true;
+            }
+        }
+        if (host == nullptr) {
+            return false;
+        }
+        ExecuteHostAtomic<T>(encoding, (T*)host);
+        return true;
+    }
+
+    static inline bool IsAtomicOperation(unsigned int funct5) {
+        switch (funct5) {
+        case 0b00010: case 0b00011: case 0b00001: case 0b00000: case 0b00100:
+        case 0b01000: case 0b01100: case 0b10000: case 0b10100: case 0b11000: case 0b11100:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    inline char* ResolveAtomic(unsigned int funct5, XLEN_t address, RISCV::TrapCause* trap) {
+        return funct5 == 0b00010 ?
+            transactor.template Resolve<IOVerb::Read>(address, trap) :
+            transactor.template Resolve<IOVerb::Write>(address, trap);
+    }
+
+    // What an AMO other than LR, SC and SWAP stores, given what it loaded.
+    template<typename T>
+    static inline T Combine(unsigned int funct5, T loaded, T operand) {
+        using U = std::make_unsigned_t<T>;
+        switch (funct5) {
+        case 0b00000: return (T)((U)loaded + (U)operand);
+        case 0b00100: return loaded ^ operand;
+        case 0b01000: return loaded | operand;
+        case 0b01100: return loaded & operand;
+        case 0b10000: return operand < loaded ? operand : loaded;
+        case 0b10100: return operand > loaded ? operand : loaded;
+        case 0b11000: return (U)operand < (U)loaded ? operand : loaded;
+        default:      return (U)operand > (U)loaded ? operand : loaded;
+        }
+    }
+
+    // An atomic on memory that isn't host memory, under atomicsLock, given
+    // the value just loaded from it. SC succeeds if the reservation holds
+    // and the memory still has the value LR saw, as on the host path.
+    template<typename T>
+    inline void ExecuteLockedAtomic(__uint32_t encoding, T loaded) {
+        unsigned int funct5 = encoding >> 27;
+        unsigned int rd = (encoding >> 7) & 0b11111;
+        unsigned int rs1 = (encoding >> 15) & 0b11111;
+        unsigned int rs2 = (encoding >> 20) & 0b11111;
+        XLEN_t address = this->state.regs[rs1];
+        T operand = (T)this->state.regs[rs2];
+        XLEN_t result = (XLEN_t)(std::make_signed_t<XLEN_t>)loaded;
+        Transaction<XLEN_t> transaction = { RISCV::TrapCause::NONE, 0 };
+        if (funct5 == 0b00010) { // LR
+            TRACE(RecordAccess(TraceRecorder::Read, address, sizeof(T)));
+            reservation = { true, address, loaded };
+        } else if (funct5 == 0b00011) { // SC
+            bool reserved = reservation.valid && reservation.address == address && (T)reservation.value == loaded;
+            reservation.valid = false;
+            result = 1;
+            if (reserved) {
+                transaction = transactor.Write(address, sizeof(T), (char*)&operand);
+                result = 0;
+            }
+        } else {
+            TRACE(RecordAccess(TraceRecorder::Read, address, sizeof(T)));
+            T stored = funct5 == 0b00001 ? operand : Combine<T>(funct5, loaded, operand);
+            transaction = transactor.Write(address, sizeof(T), (char*)&stored);
+        }
+        if (transaction.trapCause != RISCV::TrapCause::NONE) {
+            this->state.RaiseException(transaction.trapCause, address);
+            return;
+        }
+        if (rd != 0) {
+            this->state.regs[rd] = result;
+        }
+        this->state.pc += 4;
+    }
+
+    template<typename T>
+    inline void ExecuteHostAtomic(__uint32_t encoding, T* word) {
+        unsigned int funct5 = encoding >> 27;
+        unsigned int rd = (encoding >> 7) & 0b11111;
+        unsigned int rs1 = (encoding >> 15) & 0b11111;
+        unsigned int rs2 = (encoding >> 20) & 0b11111;
+        XLEN_t address = this->state.regs[rs1];
+        T operand = (T)this->state.regs[rs2];
+        T result = 0;
+        switch (funct5) {
+        case 0b00010: // LR
+            result = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            reservation = { true, address, result };
+            break;
+        case 0b00011: { // SC
+            T expected = (T)reservation.value;
+            bool reserved = reservation.valid && reservation.address == address;
+            reservation.valid = false;
+            result = reserved && __atomic_compare_exchange_n(word, &expected, operand, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ? 0 : 1;
+            break;
+        }
+        case 0b00001: result = __atomic_exchange_n(word, operand, __ATOMIC_SEQ_CST); break;
+        case 0b00000: result = __atomic_fetch_add(word, operand, __ATOMIC_SEQ_CST); break;
+        case 0b00100: result = __atomic_fetch_xor(word, operand, __ATOMIC_SEQ_CST); break;
+        case 0b01000: result = __atomic_fetch_or(word, operand, __ATOMIC_SEQ_CST); break;
+        case 0b01100: result = __atomic_fetch_and(word, operand, __ATOMIC_SEQ_CST); break;
+        default:
+            result = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            while (!__atomic_compare_exchange_n(word, &result, Combine<T>(funct5, result, operand), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            }
+            break;
+        }
+        TRACE(RecordAccess(funct5 == 0b00010 ? TraceRecorder::Read : TraceRecorder::Write, address, sizeof(T)));
+        if (rd != 0) {
+            this->state.regs[rd] = (XLEN_t)(std::make_signed_t<XLEN_t>)result;
+        }
+        this->state.pc += 4;
+    }
+
+    // The settings that change what goes in the icache for the same code.
+    inline unsigned int ICacheConfiguration() {
+        return (atomicsLock != nullptr ? 0b001 : 0) | (this->trace != nullptr ? 0b010 : 0) | (fuseInstructions ? 0b100 : 0);
+    }
+
+    inline __uint16_t CurrentASID() {
+        return (__uint16_t)this->state.satp.asid;
+    }
+
+    inline __uint32_t CurrentMode() {
+        return (((__uint32_t)this->state.privilegeMode & 0b11) << 16) | CurrentASID();
+    }
+
+    inline __uint32_t ICacheContext() {
+        return ((__uint32_t)icacheGeneration << 18) | CurrentMode();
+    }
+
+    inline bool ICacheEntryMatchesASID(SimplyCachedInstruction& entry, __uint16_t asid, bool allAsids) {
+        return entry.context >> 18 == icacheGeneration && (allAsids || (__uint16_t)entry.context == asid);
+    }
+
+    // Only sweeps the array when the 14-bit generation wraps, which keeps
+    // entries from 16384 flushes ago from coming back to life.
+    inline void InvalidateICache() {
+        if (++icacheGeneration == icacheGenerations) {
+            for (SimplyCachedInstruction& entry : icache) {
+                entry.full_pc = 1;
+            }
+            icacheGeneration = 1;
+        }
+        icacheSuperpageMark = transactor.FetchSuperpageFills();
+        if (watchCode) {
+            transactor.UnwatchAll();
+        }
+    }
+
+    inline __uint32_t XlenFields() {
+        return ((__uint32_t)this->state.misa.mxlen << 8) |
+               ((__uint32_t)this->state.mstatus.sxl << 4) |
+               (__uint32_t)this->state.mstatus.uxl;
+    }
+
+    // Point the decoder at the tables for the current privilege mode's XLEN.
+    // Entries are tagged by mode, so only a change in what XLEN a mode runs
+    // at leaves decoded instructions stale.
+    inline void CheckMode() {
+        if (this->state.privilegeMode == decodedPrivilege && XlenFields() == decodedXlens) [[ likely ]] {
+            return;
+        }
+        if (XlenFields() != decodedXlens) {
+            InvalidateICache();
+            blockGeneration++;
+        }
+        ConfigureDecoder();
+    }
+
+    inline void ConfigureDecoder() {
+        decodedPrivilege = this->state.privilegeMode;
+        decodedXlens = XlenFields();
         decoder.Configure(&this->state);
-        memset(icache, 0, sizeof(icache));
-    };
+    }
 
-    virtual inline Transactor<XLEN_t>* getVATransactor() override {
-        return &this->transactor;
+    // A store landed on code we've decoded. Drop every line for an
+    // instruction that overlaps it, including one starting 2 bytes before,
+    // or a fused pair starting up to 6 bytes before.
+    inline void CodeWritten(XLEN_t address, XLEN_t size) {
+        blockGeneration++;
+        if (codeCache != nullptr) {
+            codeCache->Revalidate();
+        }
+        if (size >= (1 << icacheBits)) {
+            InvalidateICache();
+            return;
+        }
+        XLEN_t first = (address & ~(XLEN_t)1) - 6;
+        for (XLEN_t offset = 0; offset < size + 6; offset += 2) {
+            SimplyCachedInstruction& entry = icache[((first + offset) >> 1) & ((1<<icacheBits)-1)];
+            if (entry.full_pc == first + offset) {
+                entry.full_pc = 1;
+            }
+        }
     }
 
-private:
+    inline void ApplyRemoteFences() {
+        unsigned int bits = pendingFences.exchange(0);
+        if (bits & 0b10) {
+            transactor.Clear();
+        }
+        InvalidateICache();
+        blockGeneration++;
+    }
 
-    inline void Callback(HartCallbackArgument arg) {
-        if (arg == HartCallbackArgument::RequestedVMfence)
+    // The fence operands aren't passed through the callback, so take them
+    // from the SFENCE.VMA being executed. A fence requested any other way
+    // flushes everything.
+    inline void FenceVM() {
+        __uint32_t encoding = runningVMFence;
+        blockGeneration++;
+        if (encoding == 0) {
             transactor.Clear();
-        if (arg == HartCallbackArgument::RequestedIfence || arg == HartCallbackArgument::RequestedVMfence)
-            memset(icache, 0, sizeof(icache));
+            InvalidateICache();
+            return;
+        }
+        unsigned int rs1 = (encoding >> 15) & 0b11111;
+        unsigned int rs2 = (encoding >> 20) & 0b11111;
+        XLEN_t address = this->state.regs[rs1];
+        __uint16_t asid = (__uint16_t)this->state.regs[rs2];
+        bool allAddresses = rs1 == 0;
+        bool allAsids = rs2 == 0;
+        transactor.Fence(address, allAddresses, asid, allAsids);
+        if (allAddresses && allAsids) {
+            InvalidateICache();
+            return;
+        }
+        // Code fetched through a superpage could be anywhere in it, so one
+        // 4K page's worth of icache lines isn't enough once that's happened.
+        if (allAddresses || icacheSuperpageMark != transactor.FetchSuperpageFills()) {
+            for (SimplyCachedInstruction& entry : icache) {
+                if (ICacheEntryMatchesASID(entry, asid, allAsids)) {
+                    entry.full_pc = 1;
+                }
+            }
+            return;
+        }
+        XLEN_t page = address & ~(XLEN_t)0xfff;
+        for (unsigned int offset = 0; offset < 0x1000; offset += 2) {
+            SimplyCachedInstruction& entry = icache[((page + offset) >> 1) & ((1<<icacheBits)-1)];
+            if ((entry.full_pc & ~(XLEN_t)0xfff) == page && ICacheEntryMatchesASID(entry, asid, allAsids)) {
+                entry.full_pc = 1;
+            }
+        }
+    }
+
+    inline void Callback(HartCallbackArgument arg) {
+        if (arg == HartCallbackArgument::RequestedVMfence) {
+            FenceVM();
+        }
+        if (arg == HartCallbackArgument::RequestedIfence) {
+            InvalidateICache();
+            blockGeneration++;
+            if (codeCache != nullptr) {
+                codeCache->Revalidate();
+            }
+        }
+        if (arg == HartCallbackArgument::RequestedIfence || arg == HartCallbackArgument::RequestedVMfence) {
+            if (fenceBroadcast) {
+                fenceBroadcast(arg);
+            }
+        }
         if (arg == HartCallbackArgument::ChangedMISA) {
-            memset(icache, 0, sizeof(icache));
-            decoder.Configure(&this->state);
+            InvalidateICache();
+            blockGeneration++;
+            ConfigureDecoder();
         }
         return;
     }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+// Event counts from the hart models' fast paths. They only count when built
+// with HARTMODELS_PERF_COUNTERS defined; otherwise PERF_COUNT expands to
+// nothing, the fast paths are untouched, and every counter reads zero.
+#ifdef HARTMODELS_PERF_COUNTERS
+#define PERF_COUNT(counter) (++(counter))
+#else
+#define PERF_COUNT(counter) ((void)0)
+#endif
+
+struct PerfCounters {
+
+    // OptimizedHart
+    __uint64_t icacheHits = 0;
+    __uint64_t icacheMisses = 0;
+    __uint64_t icacheEvictions = 0;
+    __uint64_t blockChains = 0;
+    __uint64_t blockLookups = 0;
+    __uint64_t blockBuilds = 0;
+    __uint64_t traps = 0;
+
+    // VirtToHostTransactor
+    __uint64_t readHits = 0;
+    __uint64_t readMisses = 0;
+    __uint64_t writeHits = 0;
+    __uint64_t writeMisses = 0;
+    __uint64_t fetchHits = 0;
+    __uint64_t fetchMisses = 0;
+    __uint64_t translations = 0;
+    __uint64_t uncachedAccesses = 0;
+
+    // CacheWrappedTranslator
+    __uint64_t translatorHits = 0;
+    __uint64_t translatorMisses = 0;
+
+    // PrecomputedDecoder
+    __uint64_t decoderRebuilds = 0;
+
+    PerfCounters& operator+=(const PerfCounters& other) {
+        icacheHits += other.icacheHits;
+        icacheMisses += other.icacheMisses;
+        icacheEvictions += other.icacheEvictions;
+        blockChains += other.blockChains;
+        blockLookups += other.blockLookups;
+        blockBuilds += other.blockBuilds;
+        traps += other.traps;
+        readHits += other.readHits;
+        readMisses += other.readMisses;
+        writeHits += other.writeHits;
+        writeMisses += other.writeMisses;
+        fetchHits += other.fetchHits;
+        fetchMisses += other.fetchMisses;
+        translations += other.translations;
+        uncachedAccesses += other.uncachedAccesses;
+        translatorHits += other.translatorHits;
+        translatorMisses += other.translatorMisses;
+        decoderRebuilds += other.decoderRebuilds;
+        return *this;
+    }
+
+};
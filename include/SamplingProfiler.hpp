@@ -0,0 +1,106 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include <HartState.hpp>
+
+#include <ElfSymbols.hpp>
+
+// Samples one hart every interval instructions: its privilege mode, pc and
+// a best-effort call stack, found by following the frame pointer chain
+// (s0/fp, with the return address saved just below each frame). Guests built
+// without frame pointers just get the pc. Results are kept as a histogram of
+// distinct stacks.
+//
+// The hart runs uninterrupted up to each sample point, so between samples
+// the profiler costs nothing per instruction.
+template<typename XLEN_t>
+class SamplingProfiler final {
+
+private:
+
+    static constexpr unsigned int maxDepth = 64;
+
+    unsigned int countdown;
+    // (privilege mode, pcs from the leaf outwards) -> samples
+    std::map<std::pair<unsigned int, std::vector<XLEN_t>>, __uint64_t> samples;
+
+public:
+
+    const unsigned int interval;
+
+    // An interval of 0 samples every instruction, as 1 does.
+    SamplingProfiler(unsigned int sampleInterval = 10007) :
+        countdown(sampleInterval == 0 ? 1 : sampleInterval),
+        interval(sampleInterval == 0 ? 1 : sampleInterval) {
+    }
+
+    // How many more instructions the hart can run before the next sample.
+    unsigned int UntilSample() const {
+        return countdown;
+    }
+
+    // Count executed instructions, sampling the hart if one is due. peek(address,
+    // &value) reads one guest word without side effects, returning false if
+    // it can't. s0 may hold anything, so harts only peek at memory they
+    // already have at hand in the host, and never reach the bus.
+    template<typename Peek>
+    inline void Advance(unsigned int executed, HartState<XLEN_t>* state, Peek peek) {
+        if (executed < countdown) [[ likely ]] {
+            countdown -= executed;
+            return;
+        }
+        countdown = interval;
+        Sample(state, peek);
+    }
+
+    void Clear() {
+        samples.clear();
+    }
+
+    // One line per distinct stack, outermost frame first, in the folded
+    // format flame graph tools read.
+    void WriteFolded(std::ostream& out, const ElfSymbols* symbols = nullptr) const {
+        for (auto& [key, count] : samples) {
+            auto& [privilege, stack] = key;
+            out << (privilege == (unsigned int)RISCV::PrivilegeMode::Machine ? "[M]" :
+                    privilege == (unsigned int)RISCV::PrivilegeMode::Supervisor ? "[S]" : "[U]");
+            for (auto frame = stack.rbegin(); frame != stack.rend(); frame++) {
+                out << ';';
+                if (symbols != nullptr) {
+                    out << symbols->Name(*frame);
+                } else {
+                    out << "0x" << std::hex << (unsigned long long)*frame << std::dec;
+                }
+            }
+            out << ' ' << count << '\n';
+        }
+    }
+
+private:
+
+    template<typename Peek>
+    void Sample(HartState<XLEN_t>* state, Peek peek) {
+        std::vector<XLEN_t> stack;
+        stack.push_back(state->pc);
+        XLEN_t fp = state->regs[8];
+        while (stack.size() < maxDepth && fp != 0 && (fp & (sizeof(XLEN_t) - 1)) == 0) {
+            XLEN_t ra;
+            XLEN_t callerFP;
+            if (!peek(fp - sizeof(XLEN_t), &ra) || !peek(fp - 2 * sizeof(XLEN_t), &callerFP) || ra == 0) {
+                break;
+            }
+            stack.push_back(ra);
+            // Stacks grow down, so a sane chain only ever moves up.
+            if (callerFP <= fp) {
+                break;
+            }
+            fp = callerFP;
+        }
+        samples[{ (unsigned int)state->privilegeMode, std::move(stack) }]++;
+    }
+
+};
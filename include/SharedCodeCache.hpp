@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <Decoder.hpp>
+
+// Decoded guest code shared between harts, keyed by the host memory behind
+// each 4K page rather than by virtual address, so it survives address space
+// switches and VM fences, and one hart's decodes serve every hart running
+// the same kernel or library text. Pages are decoded whole, at every 2-byte
+// offset, the first time any hart fetches from them.
+//
+// Each page keeps a copy of the code it was decoded from. FENCE.I, or a
+// store to watched code, only bumps an epoch; a page from an earlier epoch
+// is checked against memory when it's next looked up, and decoded again if
+// the code changed. So invalidation is cheap however much is cached, and
+// it doesn't matter which hart or device wrote the code.
+//
+// Each hart also keeps the last few pages it used, so the shared tables are
+// only consulted when a hart moves onto a page it hasn't run lately.
+template<typename XLEN_t>
+class SharedCodeCache final {
+
+public:
+
+    struct Page {
+        char code[0x1000];
+        __uint32_t encodings[0x800];
+        // nullptr for an instruction that runs off the end of the page.
+        DecodedInstruction<XLEN_t> handlers[0x800];
+        std::atomic<__uint64_t> validated;
+    };
+
+private:
+
+    using Key = std::pair<const char*, __uint64_t>;
+
+    // Lookups from different harts mostly land on different shards, so they
+    // rarely wait on each other. Each shard evicts its least recently looked
+    // up page once it's full.
+    static constexpr unsigned int shardCount = 16;
+    struct Shard {
+        std::mutex lock;
+        std::list<Key> recency;
+        std::map<Key, std::pair<std::shared_ptr<Page>, typename std::list<Key>::iterator>> pages;
+    };
+    Shard shards[shardCount];
+    std::atomic<__uint64_t> epoch = 1;
+    size_t maxShardPages;
+
+public:
+
+    // A page is about 28K on RV64, so the default holds about 14M of code
+    // and handlers. Harts keep the pages they're using when one is evicted.
+    SharedCodeCache(size_t maxPages = 512) :
+        maxShardPages(maxPages < shardCount ? 1 : maxPages / shardCount) { }
+
+    // The page of code at host, decoded by decoder. configuration identifies
+    // what the decoder is configured for (e.g. extensions and XLEN), since
+    // the same code decodes differently under another.
+    std::shared_ptr<Page> Lookup(const char* host, __uint64_t configuration, Decoder<XLEN_t>* decoder) {
+        __uint64_t current = epoch.load(std::memory_order_acquire);
+        Key key = { host, configuration };
+        Shard& shard = shards[(((std::uintptr_t)host >> 12) ^ configuration) % shardCount];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto found = shard.pages.find(key);
+        if (found != shard.pages.end()) {
+            Page* page = found->second.first.get();
+            if (page->validated.load(std::memory_order_relaxed) != current &&
+                memcmp(page->code, host, sizeof(page->code)) == 0) {
+                page->validated.store(current, std::memory_order_release);
+            }
+            if (page->validated.load(std::memory_order_relaxed) == current) {
+                shard.recency.splice(shard.recency.begin(), shard.recency, found->second.second);
+                return found->second.first;
+            }
+            // Harts may still be reading a stale page, so it's replaced rather
+            // than decoded over.
+            found->second.first = Decode(host, decoder, current);
+            shard.recency.splice(shard.recency.begin(), shard.recency, found->second.second);
+            return found->second.first;
+        }
+        while (shard.pages.size() >= maxShardPages) {
+            shard.pages.erase(shard.recency.back());
+            shard.recency.pop_back();
+        }
+        std::shared_ptr<Page> page = Decode(host, decoder, current);
+        shard.recency.push_front(key);
+        shard.pages.emplace(key, std::make_pair(page, shard.recency.begin()));
+        return page;
+    }
+
+    bool IsCurrent(const Page* page) const {
+        return page->validated.load(std::memory_order_acquire) == epoch.load(std::memory_order_acquire);
+    }
+
+    // Call after FENCE.I, or when code may have been written; safe from any
+    // thread.
+    void Revalidate() {
+        epoch.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    void Clear() {
+        for (Shard& shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            shard.pages.clear();
+            shard.recency.clear();
+        }
+    }
+
+private:
+
+    static std::shared_ptr<Page> Decode(const char* host, Decoder<XLEN_t>* decoder, __uint64_t current) {
+        std::shared_ptr<Page> page = std::make_shared<Page>();
+        memcpy(page->code, host, sizeof(page->code));
+        for (unsigned int slot = 0; slot < 0x800; slot++) {
+            __uint16_t low, high = 0;
+            memcpy(&low, page->code + slot * 2, sizeof(low));
+            bool wide = (low & 0b11) == 0b11;
+            if (wide && slot == 0x7ff) {
+                page->encodings[slot] = low;
+                page->handlers[slot] = nullptr;
+                continue;
+            }
+            if (wide) {
+                memcpy(&high, page->code + slot * 2 + 2, sizeof(high));
+            }
+            page->encodings[slot] = ((__uint32_t)high << 16) | low;
+            page->handlers[slot] = decoder->Decode(page->encodings[slot]);
+        }
+        page->validated.store(current, std::memory_order_release);
+        return page;
+    }
+
+};
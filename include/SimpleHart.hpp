@@ -4,6 +4,7 @@
 #include <cstdint>
 
 #include <Hart.hpp>
+#include <ControlFlow.hpp>
 
 #include <Translators/DirectTranslator.hpp>
 #include <Transactors/DirectTransactor.hpp>
@@ -29,7 +30,6 @@ public:
         translator(&this->state, &paTransactor),
         vaTransactor(&translator, &paTransactor),
         decoder(&this->state) {
-        // TODO callback for changing XLEN!
         Reset();
     };
 
@@ -39,6 +39,8 @@ public:
         while (true) {
             Transaction<XLEN_t> transaction = vaTransactor.Fetch(this->state.pc, sizeof(encoding), (char*)&encoding);
             if (transaction.trapCause != RISCV::TrapCause::NONE) {
+                PERF_COUNT(this->perf.traps);
+                TRACE(RecordTrap(this->state.pc));
                 this->state.RaiseException(transaction.trapCause, this->state.pc);
                 continue;
             }
@@ -46,7 +48,24 @@ public:
             // if (transaction.size != sizeof(encoding)) // TODO what if?
         }
 
+        TRACE(RecordInstruction(this->state.pc, encoding));
+#ifdef HARTMODELS_TRACE
+        XLEN_t pc = this->state.pc;
+        ControlFlow flow = ClassifyControlFlow(encoding, &this->state);
+        bool traps = flow == ControlFlow::Checked && WillTrap(encoding, &this->state);
+#endif
         decoder.Decode(encoding)(encoding, &this->state, &vaTransactor);
+#ifdef HARTMODELS_TRACE
+        if (this->state.pc != pc + ((encoding & 0b11) == 0b11 ? 4 : 2) &&
+            (flow == ControlFlow::FallsThrough || traps)) {
+            TRACE(RecordTrap(pc));
+        }
+#endif
+        if (this->profiler != nullptr) [[ unlikely ]] {
+            this->profiler->Advance(1, &this->state, [this](XLEN_t address, XLEN_t* value) {
+                return this->PeekHostMemory(address, value);
+            });
+        }
         return 1;
     };
 
@@ -58,4 +77,17 @@ public:
         return &vaTransactor;
     }
 
+    virtual SegmentsTransaction<XLEN_t> ReadSegments(const TransferSegment<XLEN_t>* segments, size_t count) override {
+        return vaTransactor.template TransactSegments<IOVerb::Read>(segments, count);
+    }
+
+    virtual SegmentsTransaction<XLEN_t> WriteSegments(const TransferSegment<XLEN_t>* segments, size_t count) override {
+        return vaTransactor.template TransactSegments<IOVerb::Write>(segments, count);
+    }
+
+    virtual void AttachTrace(TraceRecorder* recorder) override {
+        this->trace = recorder;
+        vaTransactor.trace = recorder;
+    }
+
 };
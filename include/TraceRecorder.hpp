@@ -0,0 +1,305 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Hooks for recording into a hart's TraceRecorder. They only exist when built
+// with HARTMODELS_TRACE defined; otherwise TRACE expands to nothing.
+#ifdef HARTMODELS_TRACE
+#define TRACE(call) do { if (this->trace != nullptr) { this->trace->call; } } while (0)
+#else
+#define TRACE(call) ((void)0)
+#endif
+
+// Streams one hart's instructions, data accesses and traps to a file. The hart
+// pushes fixed-size records into a single-producer single-consumer ring, and
+// a background thread encodes and writes them out. When the ring is full the
+// hart waits for the writer rather than dropping records.
+//
+// The file is the magic "HMTRACE1" followed by records. Each record starts
+// with a tag byte: the kind in bits 0-1 and, for accesses of 1, 2, 4 or 8
+// bytes, log2 of the size in bits 2-3. Bit 4 is set for any other size. Then:
+//   Instruction: zigzag varint of pc minus the previous instruction's
+//                fallthrough, then the encoding in 2 bytes, plus 2 more if the
+//                low bits of the first 2 say it's 32 bits wide.
+//   Read, Write: zigzag varint of the address minus the end of the previous
+//                access, then the size as a varint if bit 4 is set.
+//   Trap:        zigzag varint of the trapping pc minus the previous
+//                instruction's fallthrough.
+// So straight-line code costs 3-5 bytes an instruction, and sequential
+// accesses 2 bytes each.
+class TraceRecorder final {
+
+public:
+
+    enum Kind : __uint8_t {
+        Instruction = 0,
+        Read = 1,
+        Write = 2,
+        Trap = 3,
+    };
+
+private:
+
+    struct Record {
+        __uint64_t address;
+        __uint64_t size;
+        __uint32_t encoding;
+        __uint8_t kind;
+    };
+
+    static constexpr unsigned int ringBits = 16;
+    static constexpr __uint64_t ringMask = (1 << ringBits) - 1;
+
+    std::unique_ptr<Record[]> ring;
+    alignas(64) std::atomic<__uint64_t> head = 0;
+    __uint64_t cachedTail = 0;
+    alignas(64) std::atomic<__uint64_t> tail = 0;
+    std::atomic<bool> stopping = false;
+
+    FILE* file;
+    std::thread writer;
+    std::vector<unsigned char> encoded;
+    __uint64_t fallthrough = 0;
+    __uint64_t accessEnd = 0;
+
+public:
+
+    TraceRecorder(const char* path) :
+        ring(new Record[1 << ringBits]),
+        file(fopen(path, "wb")) {
+        if (file != nullptr) {
+            fwrite("HMTRACE1", 1, 8, file);
+        }
+        writer = std::thread(&TraceRecorder::Drain, this);
+    }
+
+    ~TraceRecorder() {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        if (file != nullptr) {
+            fclose(file);
+        }
+    }
+
+    bool IsOpen() const {
+        return file != nullptr;
+    }
+
+    inline void RecordInstruction(__uint64_t pc, __uint32_t encoding) {
+        Push({ pc, 0, encoding, Instruction });
+    }
+
+    inline void RecordAccess(Kind kind, __uint64_t address, __uint64_t size) {
+        Push({ address, size, 0, kind });
+    }
+
+    inline void RecordTrap(__uint64_t pc) {
+        Push({ pc, 0, 0, Trap });
+    }
+
+private:
+
+    inline void Push(const Record& record) {
+        __uint64_t position = head.load(std::memory_order_relaxed);
+        if (position - cachedTail > ringMask) [[ unlikely ]] {
+            while (position - (cachedTail = tail.load(std::memory_order_acquire)) > ringMask) {
+                std::this_thread::yield();
+            }
+        }
+        ring[position & ringMask] = record;
+        head.store(position + 1, std::memory_order_release);
+    }
+
+    void Drain() {
+        while (true) {
+            // Everything pushed before the stop request is written out.
+            bool finishing = stopping.load(std::memory_order_acquire);
+            __uint64_t end = head.load(std::memory_order_acquire);
+            __uint64_t position = tail.load(std::memory_order_relaxed);
+            bool idle = position == end;
+            while (position != end) {
+                Encode(ring[position & ringMask]);
+                position++;
+                if ((position & 0xfff) == 0) {
+                    tail.store(position, std::memory_order_release);
+                }
+            }
+            tail.store(position, std::memory_order_release);
+            if (file != nullptr && !encoded.empty()) {
+                fwrite(encoded.data(), 1, encoded.size(), file);
+            }
+            encoded.clear();
+            if (finishing) {
+                return;
+            }
+            if (idle) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+
+    inline void Encode(const Record& record) {
+        switch (record.kind) {
+        case Instruction:
+            encoded.push_back(Instruction);
+            PutDelta(record.address, fallthrough);
+            encoded.push_back(record.encoding & 0xff);
+            encoded.push_back((record.encoding >> 8) & 0xff);
+            if ((record.encoding & 0b11) == 0b11) {
+                encoded.push_back((record.encoding >> 16) & 0xff);
+                encoded.push_back(record.encoding >> 24);
+                fallthrough = record.address + 4;
+            } else {
+                fallthrough = record.address + 2;
+            }
+            break;
+        case Read:
+        case Write: {
+            bool powerOfTwo = record.size == 1 || record.size == 2 || record.size == 4 || record.size == 8;
+            __uint8_t sizeBits = record.size == 8 ? 3 : record.size == 4 ? 2 : record.size == 2 ? 1 : 0;
+            encoded.push_back(record.kind | (powerOfTwo ? sizeBits << 2 : 0b10000));
+            PutDelta(record.address, accessEnd);
+            if (!powerOfTwo) {
+                PutVarint(record.size);
+            }
+            accessEnd = record.address + record.size;
+            break;
+        }
+        case Trap:
+            encoded.push_back(Trap);
+            PutDelta(record.address, fallthrough);
+            break;
+        }
+    }
+
+    inline void PutDelta(__uint64_t value, __uint64_t reference) {
+        __int64_t delta = (__int64_t)(value - reference);
+        PutVarint(((__uint64_t)delta << 1) ^ (__uint64_t)(delta >> 63));
+    }
+
+    inline void PutVarint(__uint64_t value) {
+        while (value >= 0x80) {
+            encoded.push_back((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        encoded.push_back(value);
+    }
+
+};
+
+// Reads back a file written by TraceRecorder, one record at a time.
+class TraceReader final {
+
+public:
+
+    struct Entry {
+        TraceRecorder::Kind kind;
+        __uint64_t address; // the pc, for instructions and traps
+        __uint32_t encoding;
+        __uint64_t size;
+    };
+
+private:
+
+    FILE* file;
+    bool valid = false;
+    __uint64_t fallthrough = 0;
+    __uint64_t accessEnd = 0;
+
+public:
+
+    TraceReader(const char* path) : file(fopen(path, "rb")) {
+        char magic[8];
+        valid = file != nullptr && fread(magic, 1, 8, file) == 8 && memcmp(magic, "HMTRACE1", 8) == 0;
+    }
+
+    ~TraceReader() {
+        if (file != nullptr) {
+            fclose(file);
+        }
+    }
+
+    // Whether the file opened and starts with the trace magic.
+    bool IsOpen() const {
+        return valid;
+    }
+
+    // Decode the next record into entry. False at the end of the trace, or
+    // where it's cut short.
+    bool Next(Entry* entry) {
+        int tag = valid ? getc(file) : EOF;
+        if (tag == EOF) {
+            return false;
+        }
+        entry->kind = (TraceRecorder::Kind)(tag & 0b11);
+        entry->encoding = 0;
+        entry->size = 0;
+        switch (entry->kind) {
+        case TraceRecorder::Instruction: {
+            unsigned char bytes[4];
+            if (!GetDelta(fallthrough, &entry->address) || fread(bytes, 1, 2, file) != 2) {
+                return false;
+            }
+            entry->encoding = bytes[0] | (bytes[1] << 8);
+            if ((entry->encoding & 0b11) == 0b11) {
+                if (fread(bytes + 2, 1, 2, file) != 2) {
+                    return false;
+                }
+                entry->encoding |= (bytes[2] << 16) | ((__uint32_t)bytes[3] << 24);
+                fallthrough = entry->address + 4;
+            } else {
+                fallthrough = entry->address + 2;
+            }
+            return true;
+        }
+        case TraceRecorder::Read:
+        case TraceRecorder::Write:
+            if (!GetDelta(accessEnd, &entry->address)) {
+                return false;
+            }
+            entry->size = 1 << ((tag >> 2) & 0b11);
+            if ((tag & 0b10000) && !GetVarint(&entry->size)) {
+                return false;
+            }
+            accessEnd = entry->address + entry->size;
+            return true;
+        default:
+            return GetDelta(fallthrough, &entry->address);
+        }
+    }
+
+private:
+
+    inline bool GetDelta(__uint64_t reference, __uint64_t* value) {
+        __uint64_t zigzag;
+        if (!GetVarint(&zigzag)) {
+            return false;
+        }
+        __int64_t delta = (__int64_t)(zigzag >> 1) ^ -(__int64_t)(zigzag & 1);
+        *value = reference + (__uint64_t)delta;
+        return true;
+    }
+
+    inline bool GetVarint(__uint64_t* value) {
+        *value = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            int byte = getc(file);
+            if (byte == EOF) {
+                return false;
+            }
+            *value |= (__uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+};
@@ -1,21 +1,30 @@
 #pragma once
 
-#include <queue>
-
 #include <Transactor.hpp>
 #include <Translator.hpp>
 
-template <typename XLEN_t, bool bufferTransactions>
+#include <TraceRecorder.hpp>
+#include <TransferSegment.hpp>
+
+// The downstream types default to the abstract interfaces. Naming concrete
+// (final) types instead lets the compiler call straight into them.
+template <typename XLEN_t, bool bufferTransactions, typename TranslatorT = Translator<XLEN_t>, typename TransactorT = Transactor<XLEN_t>>
 class TranslatingTransactor final : public Transactor<XLEN_t> {
 
 private:
 
-    Translator<XLEN_t>* translator;
-    Transactor<XLEN_t>* transactor;
+    // Enough for any access up to a page long, however it's aligned.
+    static constexpr unsigned int bufferedChunks = 2;
+
+    TranslatorT* translator;
+    TransactorT* transactor;
 
 public:
 
-    TranslatingTransactor(Translator<XLEN_t>* translator, Transactor<XLEN_t>* transactor) :
+    // Loads and stores are recorded here when built with HARTMODELS_TRACE.
+    TraceRecorder* trace = nullptr;
+
+    TranslatingTransactor(TranslatorT* translator, TransactorT* transactor) :
         translator(translator), transactor(transactor) {
     }
 
@@ -31,10 +40,37 @@ public:
         return TransactInternal<IOVerb::Fetch>(startAddress, size, buf);
     }
 
+    // Perform many accesses with one call, translating each page once. Pages
+    // are performed as they translate, buffered or not, so a fault is
+    // reported at the exact byte it hit.
+    template <IOVerb verb>
+    inline SegmentsTransaction<XLEN_t> TransactSegments(const TransferSegment<XLEN_t>* segments, size_t count) {
+        SegmentsTransaction<XLEN_t> result = { RISCV::TrapCause::NONE, 0, 0 };
+        for (size_t i = 0; i < count; i++) {
+            if (segments[i].size == 0) {
+                continue;
+            }
+            if constexpr (verb != IOVerb::Fetch) {
+                TRACE(RecordAccess(verb == IOVerb::Read ? TraceRecorder::Read : TraceRecorder::Write, segments[i].address, segments[i].size));
+            }
+            Transaction<XLEN_t> transaction = TransactChunks<verb>(segments[i].address, segments[i].size, segments[i].buf);
+            result.transferred += transaction.transferredSize;
+            if (transaction.transferredSize != segments[i].size) [[ unlikely ]] {
+                result.trapCause = transaction.trapCause;
+                result.faultAddress = segments[i].address + transaction.transferredSize;
+                return result;
+            }
+        }
+        return result;
+    }
+
 private:
 
     template <IOVerb verb>
     inline Transaction<XLEN_t> TransactInternal(XLEN_t startAddress, XLEN_t size, char* buf) {
+        if constexpr (verb != IOVerb::Fetch) {
+            TRACE(RecordAccess(verb == IOVerb::Read ? TraceRecorder::Read : TraceRecorder::Write, startAddress, size));
+        }
         if constexpr (bufferTransactions) {
             return TransactBuffered<verb>(startAddress, size, buf);
         } else {
@@ -44,6 +80,17 @@ private:
 
     template <IOVerb verb>
     inline Transaction<XLEN_t> TransactImmediate(XLEN_t startAddress, XLEN_t size, char* buf) {
+        Transaction<XLEN_t> result = TransactChunks<verb>(startAddress, size, buf);
+        if (result.trapCause != RISCV::TrapCause::NONE) [[unlikely]] {
+            return { result.trapCause, 0 };
+        }
+        return result;
+    }
+
+    // Performs each page of the access as it's translated. Stops at a fault
+    // or a short transfer, reporting how much was transferred before it.
+    template <IOVerb verb>
+    inline Transaction<XLEN_t> TransactChunks(XLEN_t startAddress, XLEN_t size, char* buf) {
 
         XLEN_t endAddress = startAddress + size - 1;
         if (endAddress < startAddress) {
@@ -56,7 +103,7 @@ private:
         while (chunkStartAddress <= endAddress) {
             Translation<XLEN_t> translation = translator->template Translate<verb>(chunkStartAddress);
             if (translation.generatedTrap != RISCV::TrapCause::NONE) [[unlikely]] {
-                return { translation.generatedTrap, 0 };
+                return { translation.generatedTrap, chunkStartAddress - startAddress };
             }
             XLEN_t chunkEndAddress = translation.validThrough;
             if (chunkEndAddress > endAddress) {
@@ -67,24 +114,21 @@ private:
             XLEN_t translatedChunkStart = translation.translated + chunkStartAddress - translation.untranslated;
             Transaction<XLEN_t> chunkResult = transactor->template Transact<verb>(translatedChunkStart, chunkSize, chunkBuf);
             if (chunkResult.transferredSize != chunkSize) [[unlikely]] {
-                return chunkResult;
+                return { chunkResult.trapCause, chunkStartAddress - startAddress + chunkResult.transferredSize };
             }
             chunkStartAddress += chunkSize;
         }
         return { RISCV::TrapCause::NONE, size };
     }
 
+    // Translates every page of the access before touching any of them, so a
+    // fault part way through leaves memory as it was.
     template <IOVerb verb>
     inline Transaction<XLEN_t> TransactBuffered(XLEN_t startAddress, XLEN_t size, char* buf) {
 
-        Transaction<XLEN_t> result;
-        result.trapCause = RISCV::TrapCause::NONE;
-        result.transferredSize = 0;
-
         XLEN_t endAddress = startAddress + size - 1;
-
         if (endAddress < startAddress) {
-            return result;
+            return { RISCV::TrapCause::NONE, 0 };
         }
 
         struct BufferedTransaction {
@@ -92,46 +136,47 @@ private:
             XLEN_t size;
             char* buf;
         };
-        static std::queue<BufferedTransaction> transactionQueue;
+        BufferedTransaction transactions[bufferedChunks];
+        unsigned int count = 0;
 
         XLEN_t chunkStartAddress = startAddress;
-        while (chunkStartAddress <= endAddress) {
-
+        while (true) {
             Translation<XLEN_t> translation = translator->template Translate<verb>(chunkStartAddress);
-
-            result.trapCause = translation.generatedTrap;
-            if (result.trapCause != RISCV::TrapCause::NONE) {
-                while (!transactionQueue.empty()) {
-                    transactionQueue.pop();
-                }
-                return result;
+            if (translation.generatedTrap != RISCV::TrapCause::NONE) [[unlikely]] {
+                return { translation.generatedTrap, 0 };
             }
-
             XLEN_t chunkEndAddress = translation.validThrough;
             if (chunkEndAddress > endAddress) {
                 chunkEndAddress = endAddress;
             }
             XLEN_t chunkSize = chunkEndAddress - chunkStartAddress + 1;
-
-            char* chunkBuf = buf + (chunkStartAddress - startAddress);
-            XLEN_t translatedChunkStart = translation.translated + chunkStartAddress - translation.untranslated;
-            transactionQueue.push({translatedChunkStart, chunkSize, chunkBuf});
+            if (count < bufferedChunks) {
+                char* chunkBuf = buf + (chunkStartAddress - startAddress);
+                XLEN_t translatedChunkStart = translation.translated + chunkStartAddress - translation.untranslated;
+                transactions[count] = { translatedChunkStart, chunkSize, chunkBuf };
+            }
+            count++;
+            if (chunkEndAddress == endAddress) {
+                break;
+            }
             chunkStartAddress += chunkSize;
+        }
 
+        // Too many pages to hold on to, but they all translate, so go through
+        // them again performing each as it's translated.
+        if (count > bufferedChunks) [[unlikely]] {
+            return TransactImmediate<verb>(startAddress, size, buf);
         }
 
-        result.transferredSize = 0;
-        while (!transactionQueue.empty()) {
-            BufferedTransaction transaction = transactionQueue.front();
-            transactionQueue.pop();
+        Transaction<XLEN_t> result = { RISCV::TrapCause::NONE, 0 };
+        for (unsigned int i = 0; i < count; i++) {
             Transaction<XLEN_t> chunkResult =
-                transactor->template Transact<verb>(transaction.startAddress, transaction.size, transaction.buf);
+                transactor->template Transact<verb>(transactions[i].startAddress, transactions[i].size, transactions[i].buf);
             result.transferredSize += chunkResult.transferredSize;
-            if (chunkResult.transferredSize != transaction.size) {
+            if (chunkResult.transferredSize != transactions[i].size) {
                 break;
             }
         }
-
         return result;
     }
 
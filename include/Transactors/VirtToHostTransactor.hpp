@@ -1,55 +1,732 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
 #include <Transactor.hpp>
 
-// TODO: we may one day need to make a buffered version of this transactor where the transactions are all or nothing.
-template <typename XLEN_t, unsigned int cacheBits>
+#include <HostMemoryMap.hpp>
+
+#include <PerfCounters.hpp>
+#include <TraceRecorder.hpp>
+#include <TransferSegment.hpp>
+
+template <typename XLEN_t, unsigned int cacheBits, unsigned int superpageEntries = 8>
 class VirtToHostTransactor final : public Transactor<XLEN_t> {
 
 private:
 
+    static constexpr XLEN_t pageMask = ~(XLEN_t)0xfff;
+
     HartState<XLEN_t> *state;
     CASK::IOTarget* target;
-    DirectTransactor<XLEN_t> transactor;
-    struct CacheEntry { char *hostPageStart; XLEN_t virtPageStart; XLEN_t validThrough; };
+    HostMappedTransactor<XLEN_t> transactor;
+    const HostMemoryMap<XLEN_t>* hostMemory = nullptr;
+
+    // Entries are tagged with a context of (generation << 16 | ASID). Only
+    // entries from the current generation and the ASID in satp hit, so an
+    // address space switch doesn't need a flush, and a full flush is just a
+    // generation bump. Generation 0 is never current, so zeroed entries are
+    // empty.
+    struct CacheEntry { char *hostPageStart; XLEN_t virtPageStart; XLEN_t validThrough; __uint64_t context; };
     CacheEntry cacheR[1 << cacheBits];
     CacheEntry cacheW[1 << cacheBits];
     CacheEntry cacheX[1 << cacheBits];
 
+    // Megapages and gigapages would smear across hundreds of 4K entries, so
+    // they get a small fully associative array of their own per verb. Only
+    // superpages lying in one region of the host memory map go in it, since
+    // nothing else says the host memory behind them is contiguous; without a
+    // map (see SetHostMemoryMap()), superpages are cached 4K at a time.
+    struct SuperpageCache { CacheEntry entries[superpageEntries]; unsigned int count; unsigned int victim; };
+    SuperpageCache superR;
+    SuperpageCache superW;
+    SuperpageCache superX;
+
+    __uint64_t generation = 1;
+    // Set when a superpage had to be cached as scattered 4K granules, which
+    // an address-selective fence can't find without a full sweep.
+    bool splitSuperpages = false;
+    __uint64_t fetchSuperpageFills = 0;
+
+    // Host 4K granules holding code that a decode cache depends on, each with
+    // the virtual pages it was fetched through. Watched granules are never
+    // entered into the write caches, so every store to them takes the slow
+    // path, where codeWriteHook hears about it.
+    std::map<char*, std::vector<XLEN_t>> watchedCode;
+
+    // While logging writes, the original contents of each host 4K granule
+    // are saved before its first store, and superpages are cached for
+    // writes as 4K granules so every granule's first store misses. Only host
+    // memory in the host memory map is logged, since that's the only memory
+    // whose bounds are known, and only the part of each granule within the
+    // region being stored to is saved.
+    struct SavedGranule {
+        std::unique_ptr<char[]> data;
+        XLEN_t offset;
+        XLEN_t size;
+    };
+    bool logWrites = false;
+    std::unordered_map<char*, SavedGranule> undoLog;
+    std::vector<std::unique_ptr<char[]>> spareGranules;
+
 public:
 
-    VirtToHostTransactor(CASK::IOTarget* ioTarget, HartState<XLEN_t> *hartState) :
-        state(hartState), target(ioTarget), transactor(target) {} // TODO eliminate transactor and prefer direct IOTarget. Why did I ever separate these?
-    virtual inline Transaction<XLEN_t> Read(XLEN_t startAddress, XLEN_t size, char* buf) override { return TransactInternal<IOVerb::Read>(startAddress, size, buf); }
-    virtual inline Transaction<XLEN_t> Write(XLEN_t startAddress, XLEN_t size, char* buf) override { return TransactInternal<IOVerb::Write>(startAddress, size, buf); }
-    virtual inline Transaction<XLEN_t> Fetch(XLEN_t startAddress, XLEN_t size, char* buf) override { return TransactInternal<IOVerb::Fetch>(startAddress, size, buf); }
+    PerfCounters perf;
 
-    void Clear() {
+    // The translation caches as of SaveCaches(). The host pointers in them
+    // are only good for the target they were filled from.
+    struct Caches {
+        CASK::IOTarget* target;
+        CacheEntry cacheR[1 << cacheBits];
+        CacheEntry cacheW[1 << cacheBits];
+        CacheEntry cacheX[1 << cacheBits];
+        SuperpageCache superR;
+        SuperpageCache superW;
+        SuperpageCache superX;
+        __uint64_t generation;
+        bool splitSuperpages;
+    };
+
+    // Called with the virtual address and size of each store to watched code,
+    // once for every virtual page that code was fetched through.
+    std::function<void(XLEN_t, XLEN_t)> codeWriteHook;
+
+    // Set whenever an access lands somewhere that isn't host memory.
+    std::atomic<bool>* uncachedAccessSignal = nullptr;
+
+    // Loads and stores are recorded here when built with HARTMODELS_TRACE.
+    TraceRecorder* trace = nullptr;
+
+    VirtToHostTransactor(CASK::IOTarget* ioTarget, HartState<XLEN_t> *hartState) :
+        state(hartState), target(ioTarget), transactor(target) { // TODO eliminate transactor and prefer direct IOTarget. Why did I ever separate these?
         memset(cacheR, 0, sizeof(cacheR));
         memset(cacheW, 0, sizeof(cacheW));
         memset(cacheX, 0, sizeof(cacheX));
+        Clear();
+    }
+    virtual inline Transaction<XLEN_t> Read(XLEN_t startAddress, XLEN_t size, char* buf) override { return TransactSized<IOVerb::Read>(startAddress, size, buf); }
+    virtual inline Transaction<XLEN_t> Write(XLEN_t startAddress, XLEN_t size, char* buf) override { return TransactSized<IOVerb::Write>(startAddress, size, buf); }
+    virtual inline Transaction<XLEN_t> Fetch(XLEN_t startAddress, XLEN_t size, char* buf) override { return TransactSized<IOVerb::Fetch>(startAddress, size, buf); }
+
+    // Fixed-size accesses for callers that know the concrete transactor.
+    template <typename T>
+    inline Transaction<XLEN_t> Load(XLEN_t address, T* value) { return TransactFixed<IOVerb::Read, sizeof(T)>(address, (char*)value); }
+    template <typename T>
+    inline Transaction<XLEN_t> FetchInstruction(XLEN_t address, T* value) { return TransactFixed<IOVerb::Fetch, sizeof(T)>(address, (char*)value); }
+
+    // Serve page walks and cache fills in registered host memory without
+    // going through the bus.
+    void SetHostMemoryMap(const HostMemoryMap<XLEN_t>* map) {
+        hostMemory = map;
+        transactor.SetHostMemoryMap(map);
+        Clear();
+    }
+
+    void Clear() {
+        generation++;
+        splitSuperpages = false;
+        superR.count = superW.count = superX.count = 0;
+        superR.victim = superW.victim = superX.victim = 0;
+    }
+
+    // SFENCE.VMA: drop the translations for one address and/or ASID, or all
+    // of them when neither is given.
+    void Fence(XLEN_t address, bool allAddresses, __uint16_t asid, bool allAsids) {
+        if (allAddresses && allAsids) {
+            Clear();
+            return;
+        }
+        if (allAddresses || splitSuperpages) {
+            FenceAll(cacheR, &superR, address, allAddresses, asid, allAsids);
+            FenceAll(cacheW, &superW, address, allAddresses, asid, allAsids);
+            FenceAll(cacheX, &superX, address, allAddresses, asid, allAsids);
+            return;
+        }
+        FenceAddress(cacheR, &superR, address, asid, allAsids);
+        FenceAddress(cacheW, &superW, address, asid, allAsids);
+        FenceAddress(cacheX, &superX, address, asid, allAsids);
+    }
+
+    // Start watching the code fetched from [address, address + size) for
+    // stores. Code that isn't backed by host memory can't be watched.
+    void WatchFetch(XLEN_t address, XLEN_t size) {
+        XLEN_t last = address + size - 1;
+        for (XLEN_t granule = address & pageMask; ; granule += 0x1000) {
+            XLEN_t probe = granule < address ? address : granule;
+            CacheEntry* entry = Lookup<IOVerb::Fetch>(probe);
+            if (entry != nullptr) {
+                char* host = entry->hostPageStart + (granule - entry->virtPageStart);
+                auto [watched, inserted] = watchedCode.try_emplace(host);
+                bool known = false;
+                for (XLEN_t alias : watched->second) {
+                    known |= alias == granule;
+                }
+                if (!known) {
+                    watched->second.push_back(granule);
+                }
+                if (inserted) {
+                    EvictWrites(host);
+                }
+            }
+            if ((last & pageMask) == granule) {
+                break;
+            }
+        }
+    }
+
+    void SaveCaches(Caches* caches) {
+        caches->target = target;
+        memcpy(caches->cacheR, cacheR, sizeof(cacheR));
+        memcpy(caches->cacheW, cacheW, sizeof(cacheW));
+        memcpy(caches->cacheX, cacheX, sizeof(cacheX));
+        caches->superR = superR;
+        caches->superW = superW;
+        caches->superX = superX;
+        caches->generation = generation;
+        caches->splitSuperpages = splitSuperpages;
+    }
+
+    // Caches saved against a different target are dropped rather than
+    // rebased, since the host memory behind it may be laid out differently.
+    void RestoreCaches(const Caches* caches) {
+        if (caches->target != target) {
+            Clear();
+            return;
+        }
+        memcpy(cacheR, caches->cacheR, sizeof(cacheR));
+        memcpy(cacheW, caches->cacheW, sizeof(cacheW));
+        memcpy(cacheX, caches->cacheX, sizeof(cacheX));
+        superR = caches->superR;
+        superW = caches->superW;
+        superX = caches->superX;
+        generation = caches->generation;
+        splitSuperpages = caches->splitSuperpages;
+        if (logWrites) {
+            // Those write entries weren't filled through the undo log, so the
+            // first store to each granule wouldn't be saved.
+            memset(cacheW, 0, sizeof(cacheW));
+            superW.count = superW.victim = 0;
+        }
+        // Code watched now must keep taking the slow path for stores.
+        for (auto& watched : watchedCode) {
+            EvictWrites(watched.first);
+        }
+    }
+
+    // Start (or stop) saving what stores overwrite, from now on.
+    void LogWrites(bool enable) {
+        logWrites = enable;
+        DiscardUndoLog();
+        // Write entries filled before now would let stores go unlogged.
+        Clear();
+    }
+
+    // Put back everything stored to host memory through this transactor
+    // since LogWrites(true) or the last roll back. Costs a page copy per
+    // granule written, not per cache entry.
+    void RollBackWrites() {
+        for (auto& [granule, saved] : undoLog) {
+            memcpy(granule + saved.offset, saved.data.get(), saved.size);
+        }
+        DiscardUndoLog();
+        Clear();
+    }
+
+    void UnwatchAll() {
+        watchedCode.clear();
+    }
+
+    // Counts fetches translated through a superpage. A virtually tagged
+    // decode cache that saw this change since it was last flushed can't
+    // assume a single-address fence only touches one 4K page of code.
+    __uint64_t FetchSuperpageFills() const {
+        return fetchSuperpageFills;
+    }
+
+    // Find the host memory behind a virtual address without performing the
+    // access, so callers like host-atomic AMOs can operate on it in place.
+    // Returns nullptr with trap set on a fault, or with trap clear when the
+    // address isn't cached and isn't in the host memory map (for writes,
+    // when it isn't cached for reads either, or a store in place would miss
+    // the undo log or code watching). Callers then make the access the
+    // ordinary way, which counts and signals it if it lands outside host
+    // memory, and caches it if it doesn't.
+    template <IOVerb verb>
+    inline char* Resolve(XLEN_t address, RISCV::TrapCause* trap) {
+        *trap = RISCV::TrapCause::NONE;
+        CacheEntry* entry = Lookup<verb>(address);
+        CountLookup<verb>(entry != nullptr);
+        if (entry != nullptr) [[ likely ]] {
+            return entry->hostPageStart + address - entry->virtPageStart;
+        }
+        Translation<XLEN_t> fresh_translation = Translate<verb>(address);
+        if (fresh_translation.generatedTrap != RISCV::TrapCause::NONE) {
+            *trap = fresh_translation.generatedTrap;
+            return nullptr;
+        }
+        XLEN_t translated = fresh_translation.translated + address - fresh_translation.untranslated;
+        char* host = HostAddress(translated);
+        if constexpr (verb == IOVerb::Write) {
+            // Memory that only the target's hint leads to is known to be host
+            // memory once a load has cached the same page.
+            CacheEntry* readable = host == nullptr ? Lookup<IOVerb::Read>(address) : nullptr;
+            if (readable != nullptr) {
+                host = readable->hostPageStart + address - readable->virtPageStart;
+            }
+        }
+        if (host == nullptr || !Fill<verb>(fresh_translation, address, host)) {
+            return nullptr;
+        }
+        return host;
+    }
+
+    // Perform many accesses with one call. Each cached range (a 4K granule,
+    // or a whole superpage) is one memcpy, and each page is translated at
+    // most once. Pages are performed in order as they translate, so a fault
+    // is reported at the exact byte it hit.
+    template <IOVerb verb>
+    inline SegmentsTransaction<XLEN_t> TransactSegments(const TransferSegment<XLEN_t>* segments, size_t count) {
+        SegmentsTransaction<XLEN_t> result = { RISCV::TrapCause::NONE, 0, 0 };
+        for (size_t i = 0; i < count; i++) {
+            if (segments[i].size == 0) {
+                continue;
+            }
+            TraceAccess<verb>(segments[i].address, segments[i].size);
+            Transaction<XLEN_t> transaction = TransactPages<verb>(segments[i].address, segments[i].size, segments[i].buf);
+            result.transferred += transaction.transferredSize;
+            if (transaction.transferredSize != segments[i].size) [[ unlikely ]] {
+                result.trapCause = transaction.trapCause;
+                result.faultAddress = segments[i].address + transaction.transferredSize;
+                return result;
+            }
+        }
+        return result;
+    }
+
+    // Whether the 4K of host memory from host on is known to be one run of
+    // registered host memory, so it's safe to read whole. Host pointers from
+    // anywhere else come with no bounds.
+    inline bool IsHostGranule(const char* host) const {
+        return hostMemory != nullptr && hostMemory->Covers(host, 0x1000);
+    }
+
+    // Read guest memory only if it's already at hand: cached for reads, or in
+    // the host memory map with translation off. Never walks page tables,
+    // touches the bus, fills a cache, signals, counts or traces, so it's safe
+    // on any address, e.g. one a profiler found in a frame pointer.
+    inline bool Peek(XLEN_t address, XLEN_t size, char* buf) {
+        CacheEntry* entry = Lookup<IOVerb::Read>(address);
+        if (entry != nullptr && entry->validThrough - address >= size - 1) {
+            memcpy(buf, entry->hostPageStart + address - entry->virtPageStart, size);
+            return true;
+        }
+        RISCV::PrivilegeMode privilege = state->mstatus.mprv ? state->mstatus.mpp : state->privilegeMode;
+        if (hostMemory == nullptr ||
+            (state->satp.pagingMode != RISCV::PagingMode::Bare && privilege != RISCV::PrivilegeMode::Machine)) {
+            return false;
+        }
+        char* host = hostMemory->Find(address, size);
+        if (host == nullptr) {
+            return false;
+        }
+        memcpy(buf, host, size);
+        return true;
+    }
+
+    // Like Resolve(), but also sets length to how many bytes from address,
+    // up to length, are contiguous in host memory, for callers (e.g. DMA)
+    // that want to operate on guest memory in place. A store made this way
+    // bypasses code watching, so only ranges Resolve() would hand out for
+    // writes are returned.
+    template <IOVerb verb>
+    inline char* ResolveSpan(XLEN_t address, XLEN_t* length, RISCV::TrapCause* trap) {
+        char* host = Resolve<verb>(address, trap);
+        if (host == nullptr) {
+            return nullptr;
+        }
+        CacheEntry* entry = Lookup<verb>(address);
+        XLEN_t available = entry != nullptr ? entry->validThrough - address + 1 : 0x1000 - (address & 0xfff);
+        if (available != 0 && available < *length) {
+            *length = available;
+        }
+        return host;
     }
 
 private:
 
+    template <IOVerb verb>
+    inline CacheEntry* CacheFor() {
+        if constexpr (verb == IOVerb::Read) {
+            return cacheR;
+        } else if constexpr (verb == IOVerb::Write) {
+            return cacheW;
+        }
+        return cacheX;
+    }
+
+    template <IOVerb verb>
+    inline SuperpageCache* SuperpagesFor() {
+        if constexpr (verb == IOVerb::Read) {
+            return &superR;
+        } else if constexpr (verb == IOVerb::Write) {
+            return &superW;
+        }
+        return &superX;
+    }
+
+    template <IOVerb verb>
+    inline void CountLookup(bool hit) {
+        if constexpr (verb == IOVerb::Read) {
+            if (hit) PERF_COUNT(perf.readHits); else PERF_COUNT(perf.readMisses);
+        } else if constexpr (verb == IOVerb::Write) {
+            if (hit) PERF_COUNT(perf.writeHits); else PERF_COUNT(perf.writeMisses);
+        } else {
+            if (hit) PERF_COUNT(perf.fetchHits); else PERF_COUNT(perf.fetchMisses);
+        }
+    }
+
+    template <IOVerb verb>
+    inline void TraceAccess(XLEN_t address, XLEN_t size) {
+        if constexpr (verb != IOVerb::Fetch) {
+            TRACE(RecordAccess(verb == IOVerb::Read ? TraceRecorder::Read : TraceRecorder::Write, address, size));
+        }
+    }
+
+    // The host memory behind a physical address when it's known without an
+    // access, i.e. from the host memory map, or nullptr. Anything else only
+    // gets a host pointer from the target's hint after an access the guest
+    // actually made, so devices never see reads the guest didn't do.
+    inline char* HostAddress(XLEN_t physical) {
+        return hostMemory != nullptr ? hostMemory->Find(physical, 1) : nullptr;
+    }
+
+    // False if some of it lies outside the host memory map, and so can't be
+    // logged.
+    inline bool LogWrite(XLEN_t address, XLEN_t size, char* host) {
+        XLEN_t done = 0;
+        while (done < size) {
+            XLEN_t granuleOffset = (address + done) & 0xfff;
+            char* granule = host + done - granuleOffset;
+            const char* regionStart;
+            const char* regionEnd;
+            if (hostMemory == nullptr || !hostMemory->HostRange(host + done, &regionStart, &regionEnd)) {
+                return false;
+            }
+            auto [saved, inserted] = undoLog.try_emplace(granule);
+            if (inserted) {
+                if (spareGranules.empty()) {
+                    saved->second.data.reset(new char[0x1000]);
+                } else {
+                    saved->second.data = std::move(spareGranules.back());
+                    spareGranules.pop_back();
+                }
+                std::uintptr_t granuleStart = (std::uintptr_t)granule;
+                XLEN_t first = 0;
+                XLEN_t last = 0xfff;
+                if ((std::uintptr_t)regionStart > granuleStart) {
+                    first = (std::uintptr_t)regionStart - granuleStart;
+                }
+                if ((std::uintptr_t)regionEnd - granuleStart <= 0xfff) {
+                    last = (std::uintptr_t)regionEnd - granuleStart - 1;
+                }
+                saved->second.offset = first;
+                saved->second.size = last - first + 1;
+                memcpy(saved->second.data.get(), granule + first, saved->second.size);
+            }
+            done += 0x1000 - granuleOffset;
+        }
+        return true;
+    }
+
+    inline void DiscardUndoLog() {
+        for (auto& [granule, saved] : undoLog) {
+            spareGranules.push_back(std::move(saved.data));
+        }
+        undoLog.clear();
+    }
+
+    inline void SignalUncachedAccess() {
+        if (uncachedAccessSignal != nullptr) {
+            uncachedAccessSignal->store(true, std::memory_order_relaxed);
+        }
+    }
+
+    inline __uint64_t CurrentContext() {
+        return (generation << 16) | (__uint16_t)state->satp.asid;
+    }
+
+    template <IOVerb verb>
+    inline CacheEntry* Lookup(XLEN_t address) {
+        __uint64_t context = CurrentContext();
+        CacheEntry* entry = &CacheFor<verb>()[(address >> 12) & ((1 << cacheBits) - 1)];
+        if (entry->virtPageStart == (address & pageMask) && entry->context == context) [[ likely ]] {
+            return entry;
+        }
+        SuperpageCache* supers = SuperpagesFor<verb>();
+        for (unsigned int i = 0; i < supers->count; i++) {
+            CacheEntry* super = &supers->entries[i];
+            if (super->context == context &&
+                address - super->virtPageStart <= super->validThrough - super->virtPageStart) {
+                return super;
+            }
+        }
+        return nullptr;
+    }
+
+    // Drop write entries that would let stores reach a newly watched granule
+    // without passing through the slow path.
+    inline void EvictWrites(char* host) {
+        for (unsigned int i = 0; i < (1 << cacheBits); i++) {
+            if (cacheW[i].hostPageStart == host) {
+                cacheW[i].context = 0;
+            }
+        }
+        for (unsigned int i = 0; i < superW.count; i++) {
+            CacheEntry* super = &superW.entries[i];
+            if (host >= super->hostPageStart && host <= super->hostPageStart + (super->validThrough - super->virtPageStart)) {
+                super->context = 0;
+            }
+        }
+    }
+
+    inline bool WatchedWithin(char* hostStart, XLEN_t lastOffset) {
+        auto watched = watchedCode.lower_bound(hostStart - 0xfff);
+        return watched != watchedCode.end() && watched->first <= hostStart + lastOffset;
+    }
+
+    inline void NotifyCodeWrite(XLEN_t address, XLEN_t size, char* host) {
+        XLEN_t done = 0;
+        while (done < size) {
+            XLEN_t granuleOffset = (address + done) & 0xfff;
+            XLEN_t piece = 0x1000 - granuleOffset;
+            if (piece > size - done) {
+                piece = size - done;
+            }
+            auto watched = watchedCode.find(host + done - granuleOffset);
+            if (watched != watchedCode.end() && codeWriteHook) {
+                for (XLEN_t alias : watched->second) {
+                    codeWriteHook(alias + granuleOffset, piece);
+                }
+            }
+            done += piece;
+        }
+    }
+
+    inline bool FenceMatches(CacheEntry* entry, __uint16_t asid, bool allAsids) {
+        if (entry->context >> 16 != generation) {
+            return false;
+        }
+        return allAsids || (__uint16_t)entry->context == asid;
+    }
+
+    inline void FenceAll(CacheEntry* cache, SuperpageCache* supers, XLEN_t address, bool allAddresses, __uint16_t asid, bool allAsids) {
+        for (unsigned int i = 0; i < (1 << cacheBits); i++) {
+            if (FenceMatches(&cache[i], asid, allAsids)) {
+                cache[i].context = 0;
+            }
+        }
+        for (unsigned int i = 0; i < supers->count; i++) {
+            CacheEntry* super = &supers->entries[i];
+            if (FenceMatches(super, asid, allAsids) &&
+                (allAddresses || address - super->virtPageStart <= super->validThrough - super->virtPageStart)) {
+                super->context = 0;
+            }
+        }
+    }
+
+    inline void FenceAddress(CacheEntry* cache, SuperpageCache* supers, XLEN_t address, __uint16_t asid, bool allAsids) {
+        CacheEntry* entry = &cache[(address >> 12) & ((1 << cacheBits) - 1)];
+        if (entry->virtPageStart == (address & pageMask) && FenceMatches(entry, asid, allAsids)) {
+            entry->context = 0;
+        }
+        for (unsigned int i = 0; i < supers->count; i++) {
+            CacheEntry* super = &supers->entries[i];
+            if (FenceMatches(super, asid, allAsids) &&
+                address - super->virtPageStart <= super->validThrough - super->virtPageStart) {
+                super->context = 0;
+            }
+        }
+    }
+
+    template <IOVerb verb>
+    inline Translation<XLEN_t> Translate(XLEN_t address) {
+        PERF_COUNT(perf.translations);
+        return TranslationAlgorithm<XLEN_t, verb>(
+            address, &transactor, state->satp.ppn, state->satp.pagingMode,
+            state->mstatus.mprv ? state->mstatus.mpp : state->privilegeMode,
+            state->mstatus.mxr, state->mstatus.sum);
+    }
+
+    // Cache a fresh translation, given the host address that the access at
+    // address just landed on. A superpage is only cached whole when the host
+    // memory map puts its last byte at the matching offset from the same host
+    // pointer, i.e. the whole range is one run of host memory; otherwise just
+    // the 4K granule around the access is cached. False if nothing was
+    // cached, i.e. a store the undo log can't cover, or to watched code.
+    template <IOVerb verb>
+    inline bool Fill(Translation<XLEN_t> translation, XLEN_t address, char* host) {
+        XLEN_t lastOffset = translation.validThrough - translation.virtPageStart;
+        if constexpr (verb == IOVerb::Fetch) {
+            if (lastOffset > 0xfff) {
+                fetchSuperpageFills++;
+            }
+        }
+        if constexpr (superpageEntries != 0) {
+            if (lastOffset > 0xfff && !(verb == IOVerb::Write && logWrites)) {
+                char* hostPageStart = host - (address - translation.virtPageStart);
+                XLEN_t translatedEnd = translation.translated + translation.validThrough - translation.untranslated;
+                bool watched = false;
+                if constexpr (verb == IOVerb::Write) {
+                    watched = !watchedCode.empty() && WatchedWithin(hostPageStart, lastOffset);
+                }
+                if (!watched && HostAddress(translatedEnd) == hostPageStart + lastOffset) {
+                    SuperpageCache* supers = SuperpagesFor<verb>();
+                    unsigned int slot = supers->count;
+                    if (slot == superpageEntries) {
+                        slot = supers->victim;
+                        supers->victim = (supers->victim + 1) % superpageEntries;
+                    } else {
+                        supers->count++;
+                    }
+                    supers->entries[slot] = { hostPageStart, translation.virtPageStart, translation.validThrough, CurrentContext() };
+                    return true;
+                }
+            }
+        }
+        if (lastOffset > 0xfff) {
+            splitSuperpages = true;
+        }
+        XLEN_t granule = address & pageMask;
+        if constexpr (verb == IOVerb::Write) {
+            // Stores the log can't cover are left to the slow path.
+            if (logWrites && !LogWrite(address, 1, host)) {
+                return false;
+            }
+            if (watchedCode.count(host - (address - granule)) != 0) {
+                return false;
+            }
+        }
+        XLEN_t validThrough = granule + 0xfff;
+        if (translation.validThrough < validThrough) {
+            validThrough = translation.validThrough;
+        }
+        CacheEntry* entry = &CacheFor<verb>()[(address >> 12) & ((1 << cacheBits) - 1)];
+        *entry = { host - (address - granule), granule, validThrough, CurrentContext() };
+        return true;
+    }
+
+    template <IOVerb verb>
+    inline Transaction<XLEN_t> TransactSized(XLEN_t startAddress, XLEN_t size, char* buf) {
+        TraceAccess<verb>(startAddress, size);
+        switch (size) {
+        case 1: return TransactFixed<verb, 1>(startAddress, buf);
+        case 2: return TransactFixed<verb, 2>(startAddress, buf);
+        case 4: return TransactFixed<verb, 4>(startAddress, buf);
+        case 8: return TransactFixed<verb, 8>(startAddress, buf);
+        default: return TransactInternal<verb>(startAddress, size, buf);
+        }
+    }
+
+    // One lookup and one host load or store, when the whole access lands in
+    // a single cached range. Misses and accesses running off the end of the
+    // range take the general path.
+    template <IOVerb verb, unsigned int size>
+    inline Transaction<XLEN_t> TransactFixed(XLEN_t address, char* buf) {
+        CacheEntry* entry = Lookup<verb>(address);
+        if (entry != nullptr && entry->validThrough - address >= size - 1) [[ likely ]] {
+            CountLookup<verb>(true);
+            char* host = entry->hostPageStart + address - entry->virtPageStart;
+            if constexpr (verb == IOVerb::Write) {
+                memcpy(host, buf, size);
+            } else {
+                memcpy(buf, host, size);
+            }
+            return { RISCV::TrapCause::NONE, size };
+        }
+        return TransactInternal<verb>(address, size, buf);
+    }
+
+    // Translations CheckPages() made, for TransactPages() to use rather than
+    // walking again. Only as many are kept as a fixed-size access can cross;
+    // longer accesses walk the pages after those twice.
+    struct CheckedPages {
+        Translation<XLEN_t> translations[2];
+        unsigned int count = 0;
+    };
+
+    // Make sure every page an access crosses translates before any part of
+    // it is performed, so a fault on a later page leaves memory untouched.
+    template <IOVerb verb>
+    inline RISCV::TrapCause CheckPages(XLEN_t startAddress, XLEN_t endAddress, CheckedPages* checked) {
+        XLEN_t page = startAddress & pageMask;
+        while (true) {
+            XLEN_t probe = page < startAddress ? startAddress : page;
+            if (Lookup<verb>(probe) == nullptr) {
+                Translation<XLEN_t> translation = Translate<verb>(probe);
+                if (translation.generatedTrap != RISCV::TrapCause::NONE) {
+                    return translation.generatedTrap;
+                }
+                if (checked->count < 2) {
+                    checked->translations[checked->count++] = translation;
+                }
+            }
+            if (page == (endAddress & pageMask)) {
+                return RISCV::TrapCause::NONE;
+            }
+            page += 0x1000;
+        }
+    }
+
     template <IOVerb verb>
     inline Transaction<XLEN_t> TransactInternal(XLEN_t startAddress, XLEN_t size, char* buf) {
+        XLEN_t endAddress = startAddress + size - 1;
+        if (((startAddress ^ endAddress) & pageMask) != 0) [[ unlikely ]] {
+            CheckedPages checked;
+            RISCV::TrapCause trap = CheckPages<verb>(startAddress, endAddress, &checked);
+            if (trap != RISCV::TrapCause::NONE) {
+                return { trap, 0 };
+            }
+            return TransactPages<verb>(startAddress, size, buf, &checked);
+        }
+        return TransactPages<verb>(startAddress, size, buf);
+    }
+
+    template <IOVerb verb>
+    inline Translation<XLEN_t> TranslateOnce(XLEN_t address, const CheckedPages* checked) {
+        if (checked != nullptr) {
+            for (unsigned int i = 0; i < checked->count; i++) {
+                const Translation<XLEN_t>& translation = checked->translations[i];
+                if (address - translation.virtPageStart <= translation.validThrough - translation.virtPageStart) {
+                    return translation;
+                }
+            }
+        }
+        return Translate<verb>(address);
+    }
+
+    // Performs the access a cached range or a page at a time, stopping at a
+    // fault or a short transfer from the bus with transferredSize saying how
+    // much came before it. Pages CheckPages() already translated aren't
+    // walked again.
+    template <IOVerb verb>
+    inline Transaction<XLEN_t> TransactPages(XLEN_t startAddress, XLEN_t size, char* buf, const CheckedPages* checked = nullptr) {
         constexpr CASK::AccessType accessType = (verb == IOVerb::Read)  ? CASK::AccessType::R : (
                                                 (verb == IOVerb::Write) ? CASK::AccessType::W : (
                                                                           CASK::AccessType::X ));
-        CacheEntry* cache = cacheX;
-        if constexpr (verb == IOVerb::Read) {
-            cache = cacheR;
-        } else if constexpr (verb == IOVerb::Write) {
-            cache = cacheW;
-        }
+        XLEN_t firstAddress = startAddress;
         XLEN_t endAddress = startAddress + size - 1;
         while (startAddress <= endAddress) {
-            unsigned int index = (startAddress >> 12) & ((1 << cacheBits) - 1); // TODO assumes 4k pages, need flex for supers
-            if (cache[index].virtPageStart >> 12 == startAddress >> 12) [[ likely ]] {
-                XLEN_t chunkEndAddress = cache[index].validThrough >= endAddress ? endAddress : cache[index].validThrough;
+            CacheEntry* entry = Lookup<verb>(startAddress);
+            CountLookup<verb>(entry != nullptr);
+            if (entry != nullptr) [[ likely ]] {
+                XLEN_t chunkEndAddress = entry->validThrough >= endAddress ? endAddress : entry->validThrough;
                 XLEN_t chunkSize = chunkEndAddress - startAddress + 1;
-                char *chunkHostAddress = cache[index].hostPageStart + startAddress - cache[index].virtPageStart;
+                char *chunkHostAddress = entry->hostPageStart + startAddress - entry->virtPageStart;
                 if constexpr (verb == IOVerb::Write) {
                     memcpy(chunkHostAddress, buf, chunkSize);
                 } else {
@@ -59,23 +736,48 @@ private:
                 startAddress += chunkSize;
                 continue;
             }
-            Translation<XLEN_t> fresh_translation = TranslationAlgorithm<XLEN_t, verb>(
-                startAddress, &transactor, state->satp.ppn, state->satp.pagingMode,
-                state->mstatus.mprv ? state->mstatus.mpp : state->privilegeMode,
-                state->mstatus.mxr, state->mstatus.sum);
+            Translation<XLEN_t> fresh_translation = TranslateOnce<verb>(startAddress, checked);
             if (fresh_translation.generatedTrap != RISCV::TrapCause::NONE) [[unlikely]] {
-                return { fresh_translation.generatedTrap, 0 };
+                return { fresh_translation.generatedTrap, startAddress - firstAddress };
             }
             XLEN_t chunkEndAddress = fresh_translation.validThrough >= endAddress ? endAddress : fresh_translation.validThrough;
             XLEN_t chunkSize = chunkEndAddress - startAddress + 1;
             XLEN_t translatedChunkStart = fresh_translation.translated + startAddress - fresh_translation.untranslated;
-            /*XLEN_t transferredSize = TODO, errors if mismatch?*/
-            target->template Transact<XLEN_t, accessType>(translatedChunkStart, chunkSize, buf);
-            if (target->hint) {
-                XLEN_t offset = fresh_translation.untranslated - fresh_translation.virtPageStart;
-                cache[index].hostPageStart = (char*)target->hint - offset;
-                cache[index].virtPageStart = fresh_translation.virtPageStart;
-                cache[index].validThrough = fresh_translation.validThrough;
+            char* host = hostMemory != nullptr ? hostMemory->Find(translatedChunkStart, chunkSize) : nullptr;
+            if constexpr (verb == IOVerb::Write) {
+                if (logWrites) {
+                    // Only what lies in the host memory map can be saved first.
+                    char* destination = host != nullptr ? host : hostMemory != nullptr ? hostMemory->Find(translatedChunkStart, 1) : nullptr;
+                    if (destination != nullptr) {
+                        LogWrite(startAddress, chunkSize, destination);
+                    }
+                }
+            }
+            if (host != nullptr) {
+                if constexpr (verb == IOVerb::Write) {
+                    memcpy(host, buf, chunkSize);
+                } else {
+                    memcpy(buf, host, chunkSize);
+                }
+            } else {
+                XLEN_t transferred = target->template Transact<XLEN_t, accessType>(translatedChunkStart, chunkSize, buf);
+                if (transferred != chunkSize) [[ unlikely ]] {
+                    PERF_COUNT(perf.uncachedAccesses);
+                    SignalUncachedAccess();
+                    return { RISCV::TrapCause::NONE, startAddress - firstAddress + transferred };
+                }
+                host = (char*)target->hint;
+            }
+            if (host != nullptr) {
+                if constexpr (verb == IOVerb::Write) {
+                    if (!watchedCode.empty()) {
+                        NotifyCodeWrite(startAddress, chunkSize, host);
+                    }
+                }
+                Fill<verb>(fresh_translation, startAddress, host);
+            } else {
+                PERF_COUNT(perf.uncachedAccesses);
+                SignalUncachedAccess();
             }
             buf += chunkSize;
             startAddress += chunkSize;
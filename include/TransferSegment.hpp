@@ -0,0 +1,22 @@
+#pragma once
+
+#include <RiscV.hpp>
+
+// One piece of a scatter-gather transfer: size bytes between the guest
+// virtual address and buf.
+template<typename XLEN_t>
+struct TransferSegment {
+    XLEN_t address;
+    XLEN_t size;
+    char* buf;
+};
+
+// How far a scatter-gather transfer got. Segments are performed in order, so
+// on a fault every byte before faultAddress (transferred of them in all) has
+// been moved, and none from it on.
+template<typename XLEN_t>
+struct SegmentsTransaction {
+    RISCV::TrapCause trapCause;
+    XLEN_t transferred;
+    XLEN_t faultAddress;
+};
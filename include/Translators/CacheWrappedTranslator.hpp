@@ -1,9 +1,17 @@
 #pragma once
 
+#include <optional>
+#include <type_traits>
+
 #include <Translator.hpp>
 
-template<typename XLEN_t, unsigned int cacheBits>
-class CacheWrappedTranslator : public Translator<XLEN_t> {
+#include <PerfCounters.hpp>
+
+// Wraps either any Translator by pointer, or, given a concrete translator
+// type, one it builds and owns itself from the remaining constructor
+// arguments.
+template<typename XLEN_t, unsigned int cacheBits, typename TranslatorT = Translator<XLEN_t>>
+class CacheWrappedTranslator final : public Translator<XLEN_t> {
 
 private:
 
@@ -11,7 +19,8 @@ private:
         Translation<XLEN_t> translation;
     };
 
-    Translator<XLEN_t>* translator;
+    std::conditional_t<std::is_abstract_v<TranslatorT>, char, std::optional<TranslatorT>> ownedTranslator;
+    TranslatorT* translator;
 
     CacheEntry cacheR[1 << cacheBits];
     CacheEntry cacheW[1 << cacheBits];
@@ -19,7 +28,17 @@ private:
 
 public:
 
-    CacheWrappedTranslator(Translator<XLEN_t>* targetTranslator) : translator(targetTranslator) {
+    PerfCounters perf;
+
+    CacheWrappedTranslator(TranslatorT* targetTranslator) : translator(targetTranslator) {
+        Clear();
+    }
+
+    template<typename... Args>
+    requires (!std::is_abstract_v<TranslatorT> && std::is_constructible_v<TranslatorT, Args...>)
+    CacheWrappedTranslator(Args... args) :
+        ownedTranslator(std::in_place, args...),
+        translator(&*ownedTranslator) {
         Clear();
     }
 
@@ -55,8 +74,12 @@ private:
             cache = cacheW;
         }
         unsigned int index = (address >> 12) & ((1 << cacheBits) - 1);
-        if (cache[index].translation.untranslated >> 12 != address >> 12) [[ unlikely ]]
+        if (cache[index].translation.untranslated >> 12 != address >> 12) [[ unlikely ]] {
+            PERF_COUNT(perf.translatorMisses);
             cache[index].translation = translator->template Translate<verb>(address);
+        } else {
+            PERF_COUNT(perf.translatorHits);
+        }
         return cache[index].translation;
     }
 };
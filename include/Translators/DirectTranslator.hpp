@@ -3,17 +3,17 @@
 #include <Translator.hpp>
 #include <RiscVTranslationAlgorithm.hpp>
 
-template<typename XLEN_t>
+template<typename XLEN_t, typename TransactorT = Transactor<XLEN_t>>
 class DirectTranslator final : public Translator<XLEN_t> {
 
 private:
 
     HartState<XLEN_t>* state;
-    Transactor<XLEN_t>* transactor;
+    TransactorT* transactor;
 
 public:
 
-    DirectTranslator(HartState<XLEN_t>* hartState, Transactor<XLEN_t>* sourceTransactor)
+    DirectTranslator(HartState<XLEN_t>* hartState, TransactorT* sourceTransactor)
         : state(hartState), transactor(sourceTransactor) {
     };
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What the benchmarks share. Every benchmark is a disabled test, since they
+// take a while; run one with
+//
+//     --gtest_also_run_disabled_tests --gtest_filter='ThroughputBenchmark.*'
+//
+// (or DecodeBenchmark.*, TranslationBenchmark.*). Each result is printed as
+// one JSON object per line on stdout, and its measurements are recorded as
+// test properties too, for --gtest_output=json, so results can be collected
+// and compared between releases.
+
+namespace Benchmark {
+
+constexpr __uint32_t Extension(char letter) {
+    return 1 << (letter - 'A');
+}
+
+constexpr __uint32_t extensions =
+    Extension('I') | Extension('M') | Extension('A') | Extension('C') | Extension('S') | Extension('U');
+
+// One result, built up field by field and then reported. Measurements are
+// recorded as properties named "<key>.<field>".
+class Result final {
+
+private:
+
+    std::string key;
+    std::string json;
+    std::vector<std::pair<std::string, std::string>> properties;
+
+    void Field(const char* name, const std::string& value) {
+        json += json.empty() ? "{" : ", ";
+        json += std::string("\"") + name + "\": " + value;
+    }
+
+public:
+
+    explicit Result(const std::string& key) : key(key) {
+    }
+
+    Result& Text(const char* name, const std::string& value) {
+        Field(name, "\"" + value + "\"");
+        return *this;
+    }
+
+    Result& Count(const char* name, unsigned long long value) {
+        Field(name, std::to_string(value));
+        return *this;
+    }
+
+    Result& Measure(const char* name, double value, int precision = 3) {
+        char formatted[64];
+        snprintf(formatted, sizeof(formatted), "%.*f", precision, value);
+        Field(name, formatted);
+        properties.emplace_back(name, formatted);
+        return *this;
+    }
+
+    // A measurement this host can't make.
+    Result& Unmeasured(const char* name) {
+        Field(name, "null");
+        return *this;
+    }
+
+    void Report() {
+        printf("%s}\n", json.c_str());
+        fflush(stdout);
+        for (const auto& [name, value] : properties) {
+            ::testing::Test::RecordProperty(key + "." + name, value);
+        }
+    }
+
+};
+
+} // namespace Benchmark
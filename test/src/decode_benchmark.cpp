@@ -0,0 +1,200 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Decoders/PrecomputedDecoder.hpp>
+
+#include "Benchmark.hpp"
+
+// Decoder lookup benchmarks. Each run decodes the same stream of encodings
+// with PrecomputedDecoder and with the flat layout it replaced (one pointer
+// per packed encoding, 8 MiB per XLEN). The trace pattern walks
+// HARTMODELS_DECODE_TRACE, a raw binary of guest code (e.g. from objcopy -O
+// binary), when it's set, and a synthetic instruction mix otherwise.
+
+namespace {
+
+// PrecomputedDecoder's old layout, kept here as the baseline.
+template<typename XLEN_t>
+class FlatDecoder final : public Decoder<XLEN_t> {
+
+private:
+
+    __uint32_t extensions;
+    RISCV::XlenMode xlen;
+    std::unique_ptr<DecodedInstruction<XLEN_t>[]> uncompressed;
+    std::unique_ptr<DecodedInstruction<XLEN_t>[]> compressed;
+
+public:
+
+    FlatDecoder(HartState<XLEN_t>* hartState) :
+        uncompressed(new DecodedInstruction<XLEN_t>[1 << 20]()),
+        compressed(new DecodedInstruction<XLEN_t>[1 << 16]()) {
+        Configure(hartState);
+    }
+
+    void Configure(HartState<XLEN_t>* state) override {
+        extensions = state->misa.extensions;
+        xlen = EffectiveXlen(state);
+    }
+
+    DecodedInstruction<XLEN_t> Decode(__uint32_t encoded) override {
+        DecodedInstruction<XLEN_t>* entry = RISCV::isCompressed(encoded) ?
+            &compressed[encoded & 0x0000ffff] :
+            &uncompressed[swizzle<__uint32_t, ExtendBits::Zero, 31, 20, 14, 12, 6, 2>(encoded)];
+        if (*entry == nullptr) [[ unlikely ]] {
+            *entry = decode_instruction<XLEN_t>(encoded, extensions, xlen).executionFunction;
+        }
+        return *entry;
+    }
+
+};
+
+// Uniformly random encodings, three quarters of them 32 bits wide: the worst
+// case for locality.
+std::vector<__uint32_t> RandomEncodings(size_t count) {
+    std::mt19937 random(1);
+    std::vector<__uint32_t> encodings(count);
+    for (__uint32_t& encoding : encodings) {
+        encoding = random();
+        if ((random() & 0b11) != 0) {
+            encoding |= 0b11;
+        } else {
+            encoding &= 0xffff;
+            encoding = (encoding & ~0b11u) | (random() % 3);
+        }
+    }
+    return encodings;
+}
+
+// Common instructions with random registers and immediates, roughly in the
+// proportions compiled code uses them.
+std::vector<__uint32_t> SyntheticTrace(size_t count) {
+    static const __uint32_t templates[] = {
+        0x00000013, 0x00000013, 0x00000013, // addi
+        0x00002003, 0x00003003,             // lw, ld
+        0x00002023, 0x00003023,             // sw, sd
+        0x00000033, 0x40000033,             // add, sub
+        0x00000063, 0x00001063,             // beq, bne
+        0x0000006f, 0x00000067,             // jal, jalr
+        0x00000037, 0x00000017,             // lui, auipc
+        0x00001013, 0x00005013,             // slli, srli
+        0x02000033,                         // mul
+    };
+    static const __uint16_t compressedTemplates[] = {
+        0x0001, 0x4001, 0x6001, // c.addi, c.li, c.lui
+        0x4002, 0x8002, 0x9002, // c.lwsp, c.mv, c.add
+        0xc002, 0x4000, 0xc000, // c.swsp, c.lw, c.sw
+        0xa001, 0xc001,         // c.j, c.beqz
+    };
+    std::mt19937 random(2);
+    std::vector<__uint32_t> encodings(count);
+    for (__uint32_t& encoding : encodings) {
+        if ((random() % 3) == 0) {
+            __uint16_t base = compressedTemplates[random() % std::size(compressedTemplates)];
+            encoding = base | (random() & 0x0ffc);
+        } else {
+            __uint32_t base = templates[random() % std::size(templates)];
+            // Registers, plus immediates where the base leaves them clear.
+            encoding = base | (random() & 0x000f8f80);
+            if ((base & 0x7f) != 0b0110011) {
+                encoding |= random() & 0xfff00000;
+            }
+        }
+    }
+    return encodings;
+}
+
+std::vector<__uint32_t> TraceEncodings(size_t count, std::string& source) {
+    const char* path = getenv("HARTMODELS_DECODE_TRACE");
+    if (path == nullptr) {
+        source = "synthetic";
+        return SyntheticTrace(count);
+    }
+    std::ifstream file(path, std::ios::binary);
+    std::vector<unsigned char> code((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::vector<__uint32_t> parsed;
+    for (size_t offset = 0; offset + 2 <= code.size();) {
+        __uint32_t encoding = code[offset] | (code[offset + 1] << 8);
+        if (RISCV::isCompressed(encoding)) {
+            offset += 2;
+        } else if (offset + 4 <= code.size()) {
+            encoding |= (code[offset + 2] << 16) | (code[offset + 3] << 24);
+            offset += 4;
+        } else {
+            break;
+        }
+        parsed.push_back(encoding);
+    }
+    if (parsed.empty()) {
+        source = "synthetic";
+        return SyntheticTrace(count);
+    }
+    source = path;
+    std::vector<__uint32_t> encodings(count);
+    for (size_t i = 0; i < count; i++) {
+        encodings[i] = parsed[i % parsed.size()];
+    }
+    return encodings;
+}
+
+template<typename XLEN_t, typename DecoderType>
+void RunPattern(const char* decoderName, const char* pattern, const std::vector<__uint32_t>& encodings, unsigned int passes) {
+
+    HartState<XLEN_t> state(Benchmark::extensions);
+    DecoderType decoder(&state);
+
+    // The first pass fills the tables; only the rest are timed.
+    std::uintptr_t sink = 0;
+    for (__uint32_t encoding : encodings) {
+        sink ^= (std::uintptr_t)decoder.Decode(encoding);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int pass = 0; pass < passes; pass++) {
+        for (__uint32_t encoding : encodings) {
+            sink ^= (std::uintptr_t)decoder.Decode(encoding);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    volatile std::uintptr_t keep = sink;
+    (void)keep;
+
+    unsigned long long decodes = (unsigned long long)encodings.size() * passes;
+    Benchmark::Result(std::string(decoderName) + "." + pattern + "." + std::to_string(sizeof(XLEN_t) * 8))
+        .Text("pattern", pattern)
+        .Count("xlen", sizeof(XLEN_t) * 8)
+        .Text("decoder", decoderName)
+        .Count("decodes", decodes)
+        .Measure("ns_per_decode", seconds * 1e9 / decodes)
+        .Report();
+}
+
+template<typename XLEN_t>
+void RunAll() {
+    std::string source;
+    std::vector<__uint32_t> random = RandomEncodings(1 << 22);
+    std::vector<__uint32_t> trace = TraceEncodings(1 << 22, source);
+    Benchmark::Result("trace").Text("trace_source", source).Report();
+    RunPattern<XLEN_t, FlatDecoder<XLEN_t>>("FlatDecoder", "random", random, 8);
+    RunPattern<XLEN_t, PrecomputedDecoder<XLEN_t>>("PrecomputedDecoder", "random", random, 8);
+    RunPattern<XLEN_t, FlatDecoder<XLEN_t>>("FlatDecoder", "trace", trace, 8);
+    RunPattern<XLEN_t, PrecomputedDecoder<XLEN_t>>("PrecomputedDecoder", "trace", trace, 8);
+}
+
+} // namespace
+
+TEST(DecodeBenchmark, DISABLED_RV32) {
+    RunAll<__uint32_t>();
+}
+
+TEST(DecodeBenchmark, DISABLED_RV64) {
+    RunAll<__uint64_t>();
+}
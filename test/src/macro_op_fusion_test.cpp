@@ -0,0 +1,277 @@
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <OptimizedHart.hpp>
+
+#include <PhysicalMemory.hpp>
+
+// A fused pair has to leave the hart just where running its two instructions
+// separately would: the same registers, the same pc, and on a fault the same
+// trap. Each case runs once with fusion on and once with it off. M-mode setup
+// code turns on paging and drops into the mode under test, and traps go to an
+// M-mode handler that copies mcause, mtval and mepc into a5-a7 and spins.
+
+namespace {
+
+constexpr __uint32_t setupBase = 0x10000;
+constexpr __uint32_t bodyBase = 0x11000;
+constexpr __uint32_t handlerBase = 0x12000;
+constexpr __uint32_t dataBase = 0x20000;
+constexpr __uint32_t unmapped = 0x30000;
+constexpr __uint32_t rootTable = 0x100000;
+
+constexpr __uint32_t extensions =
+    (1 << ('I' - 'A')) | (1 << ('M' - 'A')) | (1 << ('S' - 'A')) | (1 << ('U' - 'A'));
+
+constexpr __uint32_t loadPageFault = 13;
+
+// Registers, by ABI name.
+enum : __uint32_t { zero = 0, ra = 1, t0 = 5, t1 = 6, a0 = 10, a1 = 11, a2 = 12, a5 = 15, a6 = 16, a7 = 17 };
+
+enum : __uint32_t { mstatus = 0x300, mtvec = 0x305, mepc = 0x341, mcause = 0x342, mtval = 0x343 };
+
+constexpr __uint32_t EncodeI(__uint32_t opcode, __uint32_t rd, __uint32_t funct3, __uint32_t rs1, __int32_t imm) {
+    return ((__uint32_t)(imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+constexpr __uint32_t EncodeJ(__uint32_t rd, __int32_t imm) {
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+           (((imm >> 12) & 0xff) << 12) | (rd << 7) | 0b1101111;
+}
+
+constexpr __uint32_t LUI(__uint32_t rd, __uint32_t imm20) { return (imm20 << 12) | (rd << 7) | 0b0110111; }
+constexpr __uint32_t AUIPC(__uint32_t rd, __uint32_t imm20) { return (imm20 << 12) | (rd << 7) | 0b0010111; }
+constexpr __uint32_t ADDI(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0010011, rd, 0b000, rs1, imm); }
+constexpr __uint32_t ADDIW(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0011011, rd, 0b000, rs1, imm); }
+constexpr __uint32_t SLLI(__uint32_t rd, __uint32_t rs1, __int32_t shamt) { return EncodeI(0b0010011, rd, 0b001, rs1, shamt); }
+constexpr __uint32_t SRLI(__uint32_t rd, __uint32_t rs1, __int32_t shamt) { return EncodeI(0b0010011, rd, 0b101, rs1, shamt); }
+constexpr __uint32_t SRAI(__uint32_t rd, __uint32_t rs1, __int32_t shamt) { return EncodeI(0b0010011, rd, 0b101, rs1, 0x400 | shamt); }
+constexpr __uint32_t LOAD(__uint32_t funct3, __uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0000011, rd, funct3, rs1, imm); }
+constexpr __uint32_t JALR(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b1100111, rd, 0b000, rs1, imm); }
+constexpr __uint32_t JAL(__uint32_t rd, __int32_t imm) { return EncodeJ(rd, imm); }
+constexpr __uint32_t CSRRW(__uint32_t rd, __uint32_t csr, __uint32_t rs1) { return EncodeI(0b1110011, rd, 0b001, rs1, csr); }
+constexpr __uint32_t CSRRS(__uint32_t rd, __uint32_t csr, __uint32_t rs1) { return EncodeI(0b1110011, rd, 0b010, rs1, csr); }
+constexpr __uint32_t CSRRC(__uint32_t rd, __uint32_t csr, __uint32_t rs1) { return EncodeI(0b1110011, rd, 0b011, rs1, csr); }
+constexpr __uint32_t MRET = 0x30200073;
+
+enum : __uint32_t { LB = 0b000, LH = 0b001, LW = 0b010, LD = 0b011, LBU = 0b100, LHU = 0b101, LWU = 0b110 };
+
+class Program {
+
+public:
+
+    __uint32_t base;
+    std::vector<char> bytes;
+
+    explicit Program(__uint32_t start) : base(start) {
+    }
+
+    __uint32_t Here() {
+        return base + bytes.size();
+    }
+
+    void Emit(__uint32_t instruction) {
+        for (unsigned int i = 0; i < 4; i++) {
+            bytes.push_back((instruction >> (8 * i)) & 0xff);
+        }
+    }
+
+    void EmitLoadImmediate(__uint32_t rd, __uint32_t value) {
+        __uint32_t upper = (value + 0x800) >> 12;
+        Emit(LUI(rd, upper & 0xfffff));
+        Emit(ADDI(rd, rd, (__int32_t)(value - (upper << 12))));
+    }
+
+    // auipc rd, hi; lX rd, lo(rd), loading from target.
+    void EmitAuipcLoad(__uint32_t funct3, __uint32_t rd, __uint32_t target) {
+        __uint32_t offset = target - Here();
+        __uint32_t upper = (offset + 0x800) >> 12;
+        Emit(AUIPC(rd, upper & 0xfffff));
+        Emit(LOAD(funct3, rd, rd, (__int32_t)(offset - (upper << 12))));
+    }
+
+};
+
+template<typename XLEN_t>
+struct Case {
+    std::string name;
+    RISCV::PrivilegeMode mode; // Supervisor or User
+    bool narrow;               // UXL=32, on RV64
+    std::function<void(Program&)> body;
+};
+
+template<typename XLEN_t>
+struct Outcome {
+    XLEN_t regs[32];
+    XLEN_t pc;
+};
+
+template<typename XLEN_t>
+void MapPage(CASK::PhysicalMemory& memory, XLEN_t* nextTable, XLEN_t page, XLEN_t flags) {
+    constexpr unsigned int levels = sizeof(XLEN_t) == 4 ? 2 : 3;
+    constexpr unsigned int vpnBits = sizeof(XLEN_t) == 4 ? 10 : 9;
+    XLEN_t table = rootTable;
+    for (unsigned int level = levels - 1; level > 0; level--) {
+        XLEN_t vpn = (page >> (12 + level * vpnBits)) & ((1 << vpnBits) - 1);
+        XLEN_t pte;
+        memory.Read<XLEN_t>(table + vpn * sizeof(XLEN_t), sizeof(XLEN_t), (char*)&pte);
+        if ((pte & 1) == 0) {
+            pte = ((*nextTable >> 12) << 10) | 0b1;
+            memory.Write<XLEN_t>(table + vpn * sizeof(XLEN_t), sizeof(XLEN_t), (char*)&pte);
+            *nextTable += 0x1000;
+        }
+        table = (pte >> 10) << 12;
+    }
+    XLEN_t pte = ((page >> 12) << 10) | flags;
+    memory.Write<XLEN_t>(table + ((page >> 12) & ((1 << vpnBits) - 1)) * sizeof(XLEN_t), sizeof(XLEN_t), (char*)&pte);
+}
+
+template<typename XLEN_t>
+Outcome<XLEN_t> Run(const Case<XLEN_t>& test, bool fuse) {
+    std::unique_ptr<CASK::PhysicalMemory> memory = std::make_unique<CASK::PhysicalMemory>();
+
+    bool user = test.mode == RISCV::PrivilegeMode::User;
+    XLEN_t flags = user ? 0b11011111 : 0b11001111; // D A - U X W R V
+    XLEN_t nextTable = rootTable + 0x1000;
+    MapPage<XLEN_t>(*memory, &nextTable, bodyBase, flags);
+    MapPage<XLEN_t>(*memory, &nextTable, dataBase, flags);
+    char data[0x1000];
+    for (unsigned int i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 37 + 0x91);
+    }
+    memory->Write<XLEN_t>(dataBase, sizeof(data), data);
+
+    Program setup(setupBase);
+    setup.EmitLoadImmediate(t0, handlerBase);
+    setup.Emit(CSRRW(zero, mtvec, t0));
+    setup.EmitLoadImmediate(t0, bodyBase);
+    setup.Emit(CSRRW(zero, mepc, t0));
+    setup.EmitLoadImmediate(t1, 0x1800); // MPP
+    setup.Emit(CSRRC(zero, mstatus, t1));
+    if (!user) {
+        setup.EmitLoadImmediate(t1, 0x800);
+        setup.Emit(CSRRS(zero, mstatus, t1));
+    }
+    setup.Emit(MRET);
+
+    Program body(bodyBase);
+    test.body(body);
+    body.Emit(JAL(zero, 0));
+
+    Program handler(handlerBase);
+    handler.Emit(CSRRS(a5, mcause, zero));
+    handler.Emit(CSRRS(a6, mtval, zero));
+    handler.Emit(CSRRS(a7, mepc, zero));
+    handler.Emit(JAL(zero, 0));
+
+    for (Program* program : { &setup, &body, &handler }) {
+        memory->Write<XLEN_t>(program->base, program->bytes.size(), program->bytes.data());
+    }
+
+    std::unique_ptr<OptimizedHart<XLEN_t>> hart = std::make_unique<OptimizedHart<XLEN_t>>(memory.get(), extensions);
+    hart->resetVector = setupBase;
+    hart->FuseInstructions(fuse);
+    hart->Reset();
+    hart->state.satp.pagingMode = sizeof(XLEN_t) == 4 ? RISCV::PagingMode::Sv32 : RISCV::PagingMode::Sv39;
+    hart->state.satp.ppn = rootTable >> 12;
+    if (test.narrow) {
+        hart->state.mstatus.uxl = (unsigned int)RISCV::XlenMode::XL32;
+    }
+    hart->state.regs[a1] = (XLEN_t)0xfedcba9876543210;
+    hart->quantum = 200;
+    hart->Tick();
+
+    Outcome<XLEN_t> outcome;
+    for (unsigned int i = 0; i < 32; i++) {
+        outcome.regs[i] = hart->state.regs[i];
+    }
+    outcome.pc = hart->state.pc;
+    return outcome;
+}
+
+template<typename XLEN_t>
+Outcome<XLEN_t> CheckEquivalent(const Case<XLEN_t>& test) {
+    Outcome<XLEN_t> fused = Run(test, true);
+    Outcome<XLEN_t> unfused = Run(test, false);
+    for (unsigned int i = 0; i < 32; i++) {
+        EXPECT_EQ(fused.regs[i], unfused.regs[i]) << test.name << ": x" << i;
+    }
+    EXPECT_EQ(fused.pc, unfused.pc) << test.name;
+    return fused;
+}
+
+template<typename XLEN_t>
+std::vector<Case<XLEN_t>> Cases(RISCV::PrivilegeMode mode, bool narrow) {
+    std::vector<Case<XLEN_t>> cases = {
+        { "lui-addi", mode, narrow, [](Program& p) { p.Emit(LUI(a0, 0x12345)); p.Emit(ADDI(a0, a0, 0x678)); } },
+        { "lui-addi-negative", mode, narrow, [](Program& p) { p.Emit(LUI(a0, 0x80000)); p.Emit(ADDI(a0, a0, -1)); } },
+        { "auipc-addi", mode, narrow, [](Program& p) { p.Emit(AUIPC(a0, 0x1)); p.Emit(ADDI(a0, a0, -16)); } },
+        { "auipc-jr", mode, narrow, [](Program& p) {
+            p.Emit(AUIPC(t0, 0)); p.Emit(JALR(zero, t0, 12)); p.Emit(ADDI(a1, zero, 1)); p.Emit(ADDI(a2, zero, 2)); } },
+        { "auipc-jalr", mode, narrow, [](Program& p) {
+            p.Emit(AUIPC(ra, 0)); p.Emit(JALR(ra, ra, 12)); p.Emit(ADDI(a1, zero, 1)); p.Emit(ADDI(a2, zero, 2)); } },
+        { "auipc-lb", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LB, a0, dataBase + 0x7f1); } },
+        { "auipc-lh", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LH, a0, dataBase + 0x802); } },
+        { "auipc-lw", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LW, a0, dataBase + 0xffc); } },
+        { "auipc-lbu", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LBU, a0, dataBase + 0x3); } },
+        { "auipc-lhu", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LHU, a0, dataBase + 0x12); } },
+        { "auipc-load-fault", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LW, a0, unmapped + 0x10); } },
+        { "slli-srli", mode, narrow, [](Program& p) { p.Emit(SLLI(a0, a1, 3)); p.Emit(SRLI(a0, a0, 7)); } },
+        { "slli-srai", mode, narrow, [](Program& p) { p.Emit(SLLI(a0, a1, 1)); p.Emit(SRAI(a0, a0, 9)); } },
+    };
+    if constexpr (sizeof(XLEN_t) == 8) {
+        if (!narrow) {
+            cases.push_back({ "lui-addiw", mode, narrow, [](Program& p) { p.Emit(LUI(a0, 0x7ffff)); p.Emit(ADDIW(a0, a0, 0x7ff)); } });
+            cases.push_back({ "auipc-ld", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LD, a0, dataBase + 0x808); } });
+            cases.push_back({ "auipc-lwu", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LWU, a0, dataBase + 0x404); } });
+            cases.push_back({ "slli-srai-wide", mode, narrow, [](Program& p) { p.Emit(SLLI(a0, a1, 40)); p.Emit(SRAI(a0, a0, 50)); } });
+        }
+    }
+    return cases;
+}
+
+template<typename XLEN_t>
+void CheckAll(RISCV::PrivilegeMode mode, bool narrow) {
+    for (const Case<XLEN_t>& test : Cases<XLEN_t>(mode, narrow)) {
+        CheckEquivalent(test);
+    }
+}
+
+// Fused or not, the load faults with the auipc retired and mepc on the load.
+template<typename XLEN_t>
+void CheckLoadFault(RISCV::PrivilegeMode mode, bool narrow) {
+    Outcome<XLEN_t> outcome = CheckEquivalent<XLEN_t>(
+        { "auipc-load-fault", mode, narrow, [](Program& p) { p.EmitAuipcLoad(LW, a0, unmapped + 0x10); } });
+    EXPECT_EQ(outcome.regs[a5], loadPageFault);
+    EXPECT_EQ(outcome.regs[a6], unmapped + 0x10);
+    EXPECT_EQ(outcome.regs[a7], bodyBase + 4);
+    __uint32_t upper = (unmapped + 0x10 - bodyBase + 0x800) >> 12;
+    EXPECT_EQ(outcome.regs[a0], (XLEN_t)(bodyBase + (upper << 12)));
+}
+
+} // namespace
+
+TEST(MacroOpFusion, MatchesUnfusedRV32) {
+    CheckAll<__uint32_t>(RISCV::PrivilegeMode::Supervisor, false);
+    CheckAll<__uint32_t>(RISCV::PrivilegeMode::User, false);
+}
+
+TEST(MacroOpFusion, MatchesUnfusedRV64) {
+    CheckAll<__uint64_t>(RISCV::PrivilegeMode::Supervisor, false);
+    CheckAll<__uint64_t>(RISCV::PrivilegeMode::User, false);
+}
+
+// Pairs are computed at the full XLEN, so none may fuse where UXL narrows it.
+TEST(MacroOpFusion, MatchesUnfusedAtUXL32OnRV64) {
+    CheckAll<__uint64_t>(RISCV::PrivilegeMode::User, true);
+}
+
+TEST(MacroOpFusion, FaultingLoadMatchesUnfused) {
+    CheckLoadFault<__uint32_t>(RISCV::PrivilegeMode::Supervisor, false);
+    CheckLoadFault<__uint64_t>(RISCV::PrivilegeMode::Supervisor, false);
+    CheckLoadFault<__uint64_t>(RISCV::PrivilegeMode::User, true);
+}
@@ -8,9 +8,9 @@ class PlatformFixture : public ::testing::Test {
 protected:
 
     CASK::PhysicalMemory memory;
-    SimpleHart hart;
+    SimpleHart<__uint32_t> hart;
 
-    PlatformFixture() : hart(&memory) {
+    PlatformFixture() : hart(&memory, 1 << ('I' - 'A')) {
         
     }
 
@@ -29,7 +29,7 @@ protected:
 };
 
 TEST_F(PlatformFixture, ZeroRegIsZero) {
-    EXPECT_EQ(hart.state.regs[0].Read32(), (__uint32_t)0);
+    EXPECT_EQ(hart.state.regs[0], (__uint32_t)0);
 }
 
 int main(int argc, char **argv) {
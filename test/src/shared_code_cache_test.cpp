@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <Decoders/DirectDecoder.hpp>
+#include <SharedCodeCache.hpp>
+
+namespace {
+
+constexpr __uint32_t extensions = (1 << ('I' - 'A')) | (1 << ('S' - 'A')) | (1 << ('U' - 'A'));
+
+constexpr __uint32_t ADDI(__uint32_t rd, __uint32_t rs1, __int32_t imm) {
+    return ((__uint32_t)(imm & 0xfff) << 20) | (rs1 << 15) | (rd << 7) | 0b0010011;
+}
+
+// Two pages of guest code, each an addi at every word.
+struct HostCode {
+
+    std::vector<char> bytes = std::vector<char>(0x2000);
+
+    HostCode() {
+        for (unsigned int word = 0; word < bytes.size() / 4; word++) {
+            Set(word * 4, ADDI(10, 10, word & 0x7ff));
+        }
+    }
+
+    char* Page(unsigned int index) {
+        return bytes.data() + index * 0x1000;
+    }
+
+    void Set(unsigned int offset, __uint32_t encoding) {
+        memcpy(bytes.data() + offset, &encoding, sizeof(encoding));
+    }
+
+};
+
+using Cache = SharedCodeCache<__uint32_t>;
+
+} // namespace
+
+TEST(SharedCodeCache, SharesPagesByHostAndConfiguration) {
+    HostCode code;
+    HartState<__uint32_t> state(extensions);
+    DirectDecoder<__uint32_t> decoder(&state);
+    std::unique_ptr<Cache> cache = std::make_unique<Cache>();
+
+    std::shared_ptr<Cache::Page> page = cache->Lookup(code.Page(0), 0, &decoder);
+    EXPECT_EQ(page->encodings[2], ADDI(10, 10, 1));
+    EXPECT_NE(page->handlers[2], nullptr);
+    EXPECT_EQ(cache->Lookup(code.Page(0), 0, &decoder), page);
+    EXPECT_NE(cache->Lookup(code.Page(0), 1, &decoder), page);
+    EXPECT_NE(cache->Lookup(code.Page(1), 0, &decoder), page);
+}
+
+TEST(SharedCodeCache, RevalidatesAfterEpochBump) {
+    HostCode code;
+    HartState<__uint32_t> state(extensions);
+    DirectDecoder<__uint32_t> decoder(&state);
+    std::unique_ptr<Cache> cache = std::make_unique<Cache>();
+
+    std::shared_ptr<Cache::Page> changed = cache->Lookup(code.Page(0), 0, &decoder);
+    std::shared_ptr<Cache::Page> unchanged = cache->Lookup(code.Page(1), 0, &decoder);
+
+    // Until the epoch moves on, a write to the code isn't looked for.
+    code.Set(0x10, ADDI(11, 0, 42));
+    EXPECT_EQ(cache->Lookup(code.Page(0), 0, &decoder), changed);
+    EXPECT_TRUE(cache->IsCurrent(changed.get()));
+
+    cache->Revalidate();
+    EXPECT_FALSE(cache->IsCurrent(changed.get()));
+    EXPECT_FALSE(cache->IsCurrent(unchanged.get()));
+
+    // The changed page is decoded again into a new page, leaving the old one
+    // as it was for any hart still holding it.
+    std::shared_ptr<Cache::Page> redecoded = cache->Lookup(code.Page(0), 0, &decoder);
+    EXPECT_NE(redecoded, changed);
+    EXPECT_EQ(redecoded->encodings[8], ADDI(11, 0, 42));
+    EXPECT_EQ(changed->encodings[8], ADDI(10, 10, 4));
+    EXPECT_TRUE(cache->IsCurrent(redecoded.get()));
+    EXPECT_FALSE(cache->IsCurrent(changed.get()));
+
+    // The unchanged one is kept, and current again.
+    EXPECT_EQ(cache->Lookup(code.Page(1), 0, &decoder), unchanged);
+    EXPECT_TRUE(cache->IsCurrent(unchanged.get()));
+}
+
+TEST(SharedCodeCache, LeavesInstructionsThatRunOffThePageUndecoded) {
+    HostCode code;
+    // The upper half of addi x0, x6, 0 reads as the start of a 32-bit
+    // instruction, in the page's last 2 bytes.
+    code.Set(0xffc, ADDI(0, 6, 0));
+    HartState<__uint32_t> state(extensions);
+    DirectDecoder<__uint32_t> decoder(&state);
+    std::unique_ptr<Cache> cache = std::make_unique<Cache>();
+
+    std::shared_ptr<Cache::Page> page = cache->Lookup(code.Page(0), 0, &decoder);
+    EXPECT_EQ(page->handlers[0x7ff], nullptr);
+}
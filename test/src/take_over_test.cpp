@@ -0,0 +1,137 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include <OptimizedHart.hpp>
+#include <SimpleHart.hpp>
+
+#include <PhysicalMemory.hpp>
+
+// One hart handing a guest over to a hart of another model and back, in
+// M-mode with translation off.
+
+namespace {
+
+constexpr __uint32_t codeBase = 0x10000;
+constexpr __uint32_t functionBase = 0x10100;
+
+constexpr __uint32_t extensions =
+    (1 << ('I' - 'A')) | (1 << ('M' - 'A')) | (1 << ('S' - 'A')) | (1 << ('U' - 'A'));
+
+enum : __uint32_t { zero = 0, ra = 1, t1 = 6, t2 = 7, a0 = 10 };
+
+constexpr __uint32_t EncodeI(__uint32_t opcode, __uint32_t rd, __uint32_t funct3, __uint32_t rs1, __int32_t imm) {
+    return ((__uint32_t)(imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+constexpr __uint32_t EncodeS(__uint32_t opcode, __uint32_t funct3, __uint32_t rs1, __uint32_t rs2, __int32_t imm) {
+    return (((__uint32_t)(imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+           (((__uint32_t)imm & 0x1f) << 7) | opcode;
+}
+
+constexpr __uint32_t EncodeJ(__uint32_t rd, __int32_t imm) {
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+           (((imm >> 12) & 0xff) << 12) | (rd << 7) | 0b1101111;
+}
+
+constexpr __uint32_t LUI(__uint32_t rd, __uint32_t imm20) { return (imm20 << 12) | (rd << 7) | 0b0110111; }
+constexpr __uint32_t ADDI(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0010011, rd, 0b000, rs1, imm); }
+constexpr __uint32_t SW(__uint32_t rs2, __uint32_t rs1, __int32_t imm) { return EncodeS(0b0100011, 0b010, rs1, rs2, imm); }
+constexpr __uint32_t JALR(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b1100111, rd, 0b000, rs1, imm); }
+constexpr __uint32_t JAL(__uint32_t rd, __int32_t imm) { return EncodeJ(rd, imm); }
+constexpr __uint32_t FENCE_I = 0x0000100f;
+
+class Program {
+
+public:
+
+    __uint32_t base;
+    std::vector<char> bytes;
+
+    explicit Program(__uint32_t start) : base(start) {
+    }
+
+    __uint32_t Here() {
+        return base + bytes.size();
+    }
+
+    void Emit(__uint32_t instruction) {
+        for (unsigned int i = 0; i < 4; i++) {
+            bytes.push_back((instruction >> (8 * i)) & 0xff);
+        }
+    }
+
+    void EmitLoadImmediate(__uint32_t rd, __uint32_t value) {
+        __uint32_t upper = (value + 0x800) >> 12;
+        Emit(LUI(rd, upper & 0xfffff));
+        Emit(ADDI(rd, rd, (__int32_t)(value - (upper << 12))));
+    }
+
+};
+
+// Calls a function that adds 1 to a0, patches it to add 16 instead, and
+// calls it again, so a0 ends up 17.
+//
+//     jal ra, function                    3 instructions, with the call
+//     li t1, <addi a0, a0, 16>
+//     li t2, function
+//     sw t1, 0(t2)
+//     fence.i                             6 instructions
+//     jal ra, function
+//     j .
+template<typename XLEN_t>
+void BuildPatchingProgram(CASK::PhysicalMemory& memory) {
+    Program code(codeBase);
+    code.Emit(JAL(ra, functionBase - code.Here()));
+    code.EmitLoadImmediate(t1, ADDI(a0, a0, 16));
+    code.EmitLoadImmediate(t2, functionBase);
+    code.Emit(SW(t1, t2, 0));
+    code.Emit(FENCE_I);
+    code.Emit(JAL(ra, functionBase - code.Here()));
+    code.Emit(JAL(zero, 0));
+
+    Program function(functionBase);
+    function.Emit(ADDI(a0, a0, 1));
+    function.Emit(JALR(zero, ra, 0));
+
+    memory.Write<XLEN_t>(code.base, code.bytes.size(), code.bytes.data());
+    memory.Write<XLEN_t>(function.base, function.bytes.size(), function.bytes.data());
+}
+
+template<typename XLEN_t>
+void CheckHandOff() {
+    std::unique_ptr<CASK::PhysicalMemory> memory = std::make_unique<CASK::PhysicalMemory>();
+    BuildPatchingProgram<XLEN_t>(*memory);
+    std::unique_ptr<OptimizedHart<XLEN_t>> fast = std::make_unique<OptimizedHart<XLEN_t>>(memory.get(), extensions);
+    std::unique_ptr<SimpleHart<XLEN_t>> simple = std::make_unique<SimpleHart<XLEN_t>>(memory.get(), extensions);
+    fast->resetVector = codeBase;
+    fast->Reset();
+
+    // The fast hart runs and caches the function as it first was.
+    fast->quantum = 3;
+    fast->Tick();
+    ASSERT_EQ(fast->state.regs[a0], 1);
+    ASSERT_EQ(fast->state.pc, codeBase + 4);
+
+    // The other model patches it, fencing only its own caches.
+    simple->TakeOver(*fast);
+    for (unsigned int i = 0; i < 6; i++) {
+        simple->Tick();
+    }
+    ASSERT_EQ(simple->state.pc, codeBase + 28);
+
+    // Taking back over has to drop what the fast hart had cached.
+    fast->TakeOver(*simple);
+    fast->quantum = 10;
+    fast->Tick();
+    EXPECT_EQ(fast->state.regs[a0], 17);
+    EXPECT_EQ(fast->state.pc, codeBase + 32);
+}
+
+} // namespace
+
+TEST(TakeOver, SeesCodeWrittenByTheOtherHart) {
+    CheckHandOff<__uint32_t>();
+    CheckHandOff<__uint64_t>();
+}
@@ -0,0 +1,404 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <SimpleHart.hpp>
+#include <OptimizedHart.hpp>
+#include <ComposedHart.hpp>
+
+#include <PhysicalMemory.hpp>
+
+#include "Benchmark.hpp"
+
+// Whole-program throughput benchmarks, one result per hart and workload.
+
+namespace {
+
+constexpr __uint32_t codeBase = 0x10000;
+constexpr __uint32_t dataBase = 0x200000;
+constexpr __uint32_t dataSize = 0x100000;
+constexpr __uint32_t pageTableBase = 0x400000;
+
+// Registers, by ABI name.
+enum : __uint32_t { zero = 0, ra = 1, sp = 2, t0 = 5, t1 = 6, t2 = 7, s0 = 8, s1 = 9,
+                    a0 = 10, a1 = 11, a2 = 12, a3 = 13, a4 = 14, a5 = 15, t3 = 28, t4 = 29, t5 = 30 };
+
+constexpr __uint32_t EncodeR(__uint32_t opcode, __uint32_t rd, __uint32_t funct3, __uint32_t rs1, __uint32_t rs2, __uint32_t funct7) {
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+constexpr __uint32_t EncodeI(__uint32_t opcode, __uint32_t rd, __uint32_t funct3, __uint32_t rs1, __int32_t imm) {
+    return ((__uint32_t)(imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+constexpr __uint32_t EncodeS(__uint32_t funct3, __uint32_t rs1, __uint32_t rs2, __int32_t imm) {
+    return (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((imm & 0x1f) << 7) | 0b0100011;
+}
+
+constexpr __uint32_t EncodeB(__uint32_t funct3, __uint32_t rs1, __uint32_t rs2, __int32_t imm) {
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15) |
+           (funct3 << 12) | (((imm >> 1) & 0xf) << 8) | (((imm >> 11) & 1) << 7) | 0b1100011;
+}
+
+constexpr __uint32_t EncodeJ(__uint32_t rd, __int32_t imm) {
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20) |
+           (((imm >> 12) & 0xff) << 12) | (rd << 7) | 0b1101111;
+}
+
+constexpr __uint32_t ADD(__uint32_t rd, __uint32_t rs1, __uint32_t rs2) { return EncodeR(0b0110011, rd, 0b000, rs1, rs2, 0b0000000); }
+constexpr __uint32_t SUB(__uint32_t rd, __uint32_t rs1, __uint32_t rs2) { return EncodeR(0b0110011, rd, 0b000, rs1, rs2, 0b0100000); }
+constexpr __uint32_t XOR(__uint32_t rd, __uint32_t rs1, __uint32_t rs2) { return EncodeR(0b0110011, rd, 0b100, rs1, rs2, 0b0000000); }
+constexpr __uint32_t MUL(__uint32_t rd, __uint32_t rs1, __uint32_t rs2) { return EncodeR(0b0110011, rd, 0b000, rs1, rs2, 0b0000001); }
+constexpr __uint32_t ADDI(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0010011, rd, 0b000, rs1, imm); }
+constexpr __uint32_t ANDI(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0010011, rd, 0b111, rs1, imm); }
+constexpr __uint32_t SLLI(__uint32_t rd, __uint32_t rs1, __int32_t shamt) { return EncodeI(0b0010011, rd, 0b001, rs1, shamt); }
+constexpr __uint32_t SRLI(__uint32_t rd, __uint32_t rs1, __int32_t shamt) { return EncodeI(0b0010011, rd, 0b101, rs1, shamt); }
+constexpr __uint32_t LW(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0000011, rd, 0b010, rs1, imm); }
+constexpr __uint32_t LD(__uint32_t rd, __uint32_t rs1, __int32_t imm) { return EncodeI(0b0000011, rd, 0b011, rs1, imm); }
+constexpr __uint32_t SW(__uint32_t rs2, __uint32_t rs1, __int32_t imm) { return EncodeS(0b010, rs1, rs2, imm); }
+constexpr __uint32_t LUI(__uint32_t rd, __uint32_t imm20) { return (imm20 << 12) | (rd << 7) | 0b0110111; }
+constexpr __uint32_t BEQ(__uint32_t rs1, __uint32_t rs2, __int32_t imm) { return EncodeB(0b000, rs1, rs2, imm); }
+constexpr __uint32_t BNE(__uint32_t rs1, __uint32_t rs2, __int32_t imm) { return EncodeB(0b001, rs1, rs2, imm); }
+constexpr __uint32_t JAL(__uint32_t rd, __int32_t imm) { return EncodeJ(rd, imm); }
+
+constexpr __uint16_t C_ADDI(__uint32_t rd, __int32_t imm) {
+    return (((imm >> 5) & 1) << 12) | (rd << 7) | ((imm & 0x1f) << 2) | 0b01;
+}
+constexpr __uint16_t C_ADD(__uint32_t rd, __uint32_t rs2) { return (0b1001 << 12) | (rd << 7) | (rs2 << 2) | 0b10; }
+constexpr __uint16_t C_MV(__uint32_t rd, __uint32_t rs2) { return (0b1000 << 12) | (rd << 7) | (rs2 << 2) | 0b10; }
+constexpr __uint16_t C_SLLI(__uint32_t rd, __uint32_t shamt) { return (((shamt >> 5) & 1) << 12) | (rd << 7) | ((shamt & 0x1f) << 2) | 0b10; }
+constexpr __uint16_t C_LW(__uint32_t rd, __uint32_t rs1, __uint32_t offset) {
+    return (0b010 << 13) | (((offset >> 3) & 0b111) << 10) | ((rs1 - 8) << 7) |
+           (((offset >> 2) & 1) << 6) | (((offset >> 6) & 1) << 5) | ((rd - 8) << 2);
+}
+constexpr __uint16_t C_SW(__uint32_t rs2, __uint32_t rs1, __uint32_t offset) {
+    return (0b110 << 13) | (((offset >> 3) & 0b111) << 10) | ((rs1 - 8) << 7) |
+           (((offset >> 2) & 1) << 6) | (((offset >> 6) & 1) << 5) | ((rs2 - 8) << 2);
+}
+constexpr __uint16_t C_BNEZ(__uint32_t rs1, __int32_t offset) {
+    return (0b111 << 13) | (((offset >> 8) & 1) << 12) | (((offset >> 3) & 0b11) << 10) | ((rs1 - 8) << 7) |
+           (((offset >> 6) & 0b11) << 5) | (((offset >> 1) & 0b11) << 3) | (((offset >> 5) & 1) << 2) | 0b01;
+}
+constexpr __uint16_t C_J(__int32_t offset) {
+    return (0b101 << 13) | (((offset >> 11) & 1) << 12) | (((offset >> 4) & 1) << 11) | (((offset >> 8) & 0b11) << 9) |
+           (((offset >> 10) & 1) << 8) | (((offset >> 6) & 1) << 7) | (((offset >> 7) & 1) << 6) |
+           (((offset >> 1) & 0b111) << 3) | (((offset >> 5) & 1) << 2) | 0b01;
+}
+
+class Program {
+
+public:
+
+    std::vector<char> bytes;
+
+    __int32_t Here() {
+        return bytes.size();
+    }
+
+    void Emit(__uint32_t instruction) {
+        for (unsigned int i = 0; i < 4; i++) {
+            bytes.push_back((instruction >> (8 * i)) & 0xff);
+        }
+    }
+
+    void EmitCompressed(__uint16_t instruction) {
+        bytes.push_back(instruction & 0xff);
+        bytes.push_back(instruction >> 8);
+    }
+
+    // Load a constant below 2^31 without relying on lui sign extension.
+    void EmitLoadImmediate(__uint32_t rd, __uint32_t value) {
+        __uint32_t upper = (value + 0x800) >> 12;
+        __int32_t lower = (__int32_t)(value - (upper << 12));
+        if (upper != 0) {
+            Emit(LUI(rd, upper));
+            Emit(ADDI(rd, rd, lower));
+        } else {
+            Emit(ADDI(rd, zero, lower));
+        }
+    }
+
+};
+
+template<typename XLEN_t>
+void WriteMemory(CASK::PhysicalMemory& memory, XLEN_t address, XLEN_t size, char* buf) {
+    memory.Write<XLEN_t>(address, size, buf);
+}
+
+// Arithmetic only, so this measures dispatch more than anything.
+template<typename XLEN_t>
+void IntegerLoop(Program& program, CASK::PhysicalMemory&) {
+    program.Emit(ADDI(t0, zero, 0));
+    program.Emit(ADDI(t1, zero, 1));
+    program.Emit(ADDI(t2, zero, 3));
+    __int32_t loop = program.Here();
+    program.Emit(ADD(t0, t0, t1));
+    program.Emit(XOR(t1, t1, t0));
+    program.Emit(SLLI(t3, t0, 3));
+    program.Emit(SRLI(t4, t1, 2));
+    program.Emit(ADD(t1, t3, t4));
+    program.Emit(MUL(t5, t0, t2));
+    program.Emit(ADDI(t2, t2, 7));
+    program.Emit(SUB(t0, t0, t5));
+    program.Emit(JAL(zero, loop - program.Here()));
+}
+
+// Read-modify-write sweeps over a buffer bigger than the host caches like.
+template<typename XLEN_t>
+void MemoryStreaming(Program& program, CASK::PhysicalMemory&) {
+    __int32_t outer = program.Here();
+    program.EmitLoadImmediate(a0, dataBase);
+    program.EmitLoadImmediate(a1, dataBase + dataSize);
+    __int32_t inner = program.Here();
+    for (__int32_t offset = 0; offset < 16; offset += 4) {
+        program.Emit(LW(t0, a0, offset));
+        program.Emit(ADD(t1, t1, t0));
+        program.Emit(SW(t1, a0, offset));
+    }
+    program.Emit(ADDI(a0, a0, 16));
+    program.Emit(BNE(a0, a1, inner - program.Here()));
+    program.Emit(JAL(zero, outer - program.Here()));
+}
+
+// Dependent loads around a random cycle of cache-line-sized nodes.
+template<typename XLEN_t>
+void PointerChasing(Program& program, CASK::PhysicalMemory& memory) {
+    constexpr unsigned int nodeSize = 64;
+    constexpr unsigned int nodes = dataSize / nodeSize;
+    std::vector<unsigned int> order(nodes);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin() + 1, order.end(), std::mt19937(1));
+    for (unsigned int i = 0; i < nodes; i++) {
+        XLEN_t node = dataBase + order[i] * nodeSize;
+        XLEN_t next = dataBase + order[(i + 1) % nodes] * nodeSize;
+        WriteMemory<XLEN_t>(memory, node, sizeof(next), (char*)&next);
+    }
+    program.EmitLoadImmediate(a0, dataBase);
+    __int32_t loop = program.Here();
+    for (unsigned int i = 0; i < 8; i++) {
+        program.Emit(sizeof(XLEN_t) == 8 ? LD(a0, a0, 0) : LW(a0, a0, 0));
+    }
+    program.Emit(JAL(zero, loop - program.Here()));
+}
+
+// Data-dependent branches driven by an LCG.
+template<typename XLEN_t>
+void Branchy(Program& program, CASK::PhysicalMemory&) {
+    program.EmitLoadImmediate(s1, 1103515245);
+    program.Emit(ADDI(t0, zero, 1));
+    __int32_t loop = program.Here();
+    program.Emit(MUL(t0, t0, s1));
+    program.Emit(ADDI(t0, t0, 0x39));
+    for (__int32_t bit = 4; bit < 12; bit++) {
+        program.Emit(SRLI(t1, t0, bit));
+        program.Emit(ANDI(t1, t1, 1));
+        program.Emit(BEQ(t1, zero, 8));
+        program.Emit(ADDI(t2, t2, bit));
+    }
+    program.Emit(JAL(zero, loop - program.Here()));
+}
+
+// Mostly 16-bit encodings, to exercise the compressed decode path.
+template<typename XLEN_t>
+void CompressedHeavy(Program& program, CASK::PhysicalMemory&) {
+    program.EmitLoadImmediate(s0, dataBase);
+    __int32_t outer = program.Here();
+    program.Emit(ADDI(a5, zero, 64));
+    __int32_t loop = program.Here();
+    program.EmitCompressed(C_ADDI(a0, 1));
+    program.EmitCompressed(C_ADD(a1, a0));
+    program.EmitCompressed(C_MV(a2, a1));
+    program.EmitCompressed(C_SLLI(a2, 1));
+    program.EmitCompressed(C_LW(a3, s0, 0));
+    program.EmitCompressed(C_ADD(a3, a2));
+    program.EmitCompressed(C_SW(a3, s0, 4));
+    program.EmitCompressed(C_ADDI(a5, -1));
+    program.EmitCompressed(C_BNEZ(a5, loop - program.Here()));
+    program.EmitCompressed(C_J(outer - program.Here()));
+}
+
+// Identity-map the first 4 MiB with 4K pages, so the paged variants walk
+// real page tables on every translation miss.
+template<typename XLEN_t>
+void BuildIdentityPageTables(CASK::PhysicalMemory& memory) {
+    constexpr bool sv32 = sizeof(XLEN_t) == 4;
+    constexpr unsigned int levels = sv32 ? 2 : 3;
+    constexpr unsigned int vpnBits = sv32 ? 10 : 9;
+    constexpr XLEN_t pteSize = sizeof(XLEN_t);
+    constexpr XLEN_t leaf = 0b11001111; // D A - - X W R V
+    constexpr XLEN_t pointer = 0b00000001;
+    XLEN_t nextTable = pageTableBase + 0x1000;
+    for (XLEN_t page = 0; page < 0x400000; page += 0x1000) {
+        XLEN_t table = pageTableBase;
+        for (unsigned int level = levels - 1; level > 0; level--) {
+            XLEN_t vpn = (page >> (12 + level * vpnBits)) & ((1 << vpnBits) - 1);
+            XLEN_t pte;
+            memory.Read<XLEN_t>(table + vpn * pteSize, pteSize, (char*)&pte);
+            if ((pte & 1) == 0) {
+                pte = ((nextTable >> 12) << 10) | pointer;
+                WriteMemory<XLEN_t>(memory, table + vpn * pteSize, pteSize, (char*)&pte);
+                nextTable += 0x1000;
+            }
+            table = (pte >> 10) << 12;
+        }
+        XLEN_t vpn = (page >> 12) & ((1 << vpnBits) - 1);
+        XLEN_t pte = ((page >> 12) << 10) | leaf;
+        WriteMemory<XLEN_t>(memory, table + vpn * pteSize, pteSize, (char*)&pte);
+    }
+}
+
+template<typename XLEN_t>
+struct Workload {
+    const char* name;
+    void (*build)(Program&, CASK::PhysicalMemory&);
+    bool paged;
+};
+
+template<typename XLEN_t>
+std::vector<Workload<XLEN_t>> Workloads() {
+    return {
+        { "integer", IntegerLoop<XLEN_t>, false },
+        { "streaming", MemoryStreaming<XLEN_t>, false },
+        { "pointer-chasing", PointerChasing<XLEN_t>, false },
+        { "branchy", Branchy<XLEN_t>, false },
+        { "compressed", CompressedHeavy<XLEN_t>, false },
+        { "paged-integer", IntegerLoop<XLEN_t>, true },
+        { "paged-streaming", MemoryStreaming<XLEN_t>, true },
+        { "paged-pointer-chasing", PointerChasing<XLEN_t>, true },
+    };
+}
+
+// The host's cycle counter, where user code can read one. Elsewhere cycles
+// go unmeasured.
+#if defined(__x86_64__) || defined(__i386__)
+constexpr bool hostCyclesMeasurable = true;
+inline unsigned long long HostCycles() {
+    return __rdtsc();
+}
+#else
+constexpr bool hostCyclesMeasurable = false;
+inline unsigned long long HostCycles() {
+    return 0;
+}
+#endif
+
+// Linux keeps one peak resident set size per process, so each run resets it
+// to the current size before starting and reads it back afterwards. Both
+// return -1 where /proc doesn't support that.
+inline long ResetPeakRss() {
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file == nullptr) {
+        return -1;
+    }
+    bool reset = fputs("5", file) >= 0;
+    return fclose(file) == 0 && reset ? 0 : -1;
+}
+
+inline long PeakRssKb() {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file == nullptr) {
+        return -1;
+    }
+    long kb = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kb = strtol(line + 6, nullptr, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+template<typename XLEN_t, typename HartType>
+void RunWorkload(const char* hartName, const Workload<XLEN_t>& workload, unsigned long long budget,
+                 std::function<void(HartType*)> configure = nullptr) {
+
+    bool measureRss = ResetPeakRss() == 0;
+
+    std::unique_ptr<CASK::PhysicalMemory> memory = std::make_unique<CASK::PhysicalMemory>();
+    Program program;
+    workload.build(program, *memory);
+    WriteMemory<XLEN_t>(*memory, codeBase, program.bytes.size(), program.bytes.data());
+
+    std::unique_ptr<HartType> hart = std::make_unique<HartType>(memory.get(), Benchmark::extensions);
+    hart->resetVector = codeBase;
+    if (configure) {
+        configure(hart.get());
+    }
+    hart->Reset();
+    if (workload.paged) {
+        BuildIdentityPageTables<XLEN_t>(*memory);
+        hart->state.satp.pagingMode = sizeof(XLEN_t) == 4 ? RISCV::PagingMode::Sv32 : RISCV::PagingMode::Sv39;
+        hart->state.satp.ppn = pageTableBase >> 12;
+        hart->state.privilegeMode = RISCV::PrivilegeMode::Supervisor;
+    }
+
+    unsigned long long retired = 0;
+    auto start = std::chrono::steady_clock::now();
+    unsigned long long startCycles = HostCycles();
+    while (retired < budget) {
+        retired += hart->Tick();
+    }
+    unsigned long long cycles = HostCycles() - startCycles;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    long peakRssKb = measureRss ? PeakRssKb() : -1;
+
+    Benchmark::Result result(std::string(hartName) + "." + workload.name);
+    result.Text("workload", workload.name)
+          .Count("xlen", sizeof(XLEN_t) * 8)
+          .Text("hart", hartName)
+          .Count("instructions", retired)
+          .Measure("seconds", seconds, 6)
+          .Measure("mips", retired / seconds / 1e6);
+    if (hostCyclesMeasurable) {
+        result.Measure("host_cycles_per_instruction", (double)cycles / retired);
+    } else {
+        result.Unmeasured("host_cycles_per_instruction");
+    }
+    if (peakRssKb >= 0) {
+        result.Measure("peak_rss_kb", peakRssKb, 0);
+    } else {
+        result.Unmeasured("peak_rss_kb");
+    }
+    result.Report();
+}
+
+template<typename XLEN_t>
+void RunAll() {
+    for (const Workload<XLEN_t>& workload : Workloads<XLEN_t>()) {
+        RunWorkload<XLEN_t, SimpleHart<XLEN_t>>("SimpleHart", workload, 5000000);
+        RunWorkload<XLEN_t, ComposedHart<XLEN_t>>("ComposedHart", workload, 5000000);
+        RunWorkload<XLEN_t, CachedBufferedHart<XLEN_t>>("CachedBufferedHart", workload, 5000000);
+        RunWorkload<XLEN_t, OptimizedHart<XLEN_t>>("OptimizedHart", workload, 100000000);
+        RunWorkload<XLEN_t, OptimizedHart<XLEN_t>>("OptimizedHart-unfused", workload, 100000000,
+                                                   [](OptimizedHart<XLEN_t>* hart) { hart->FuseInstructions(false); });
+        RunWorkload<XLEN_t, OptimizedHart<XLEN_t, true>>("OptimizedHart+blocks", workload, 100000000);
+    }
+}
+
+} // namespace
+
+TEST(ThroughputBenchmark, DISABLED_RV32) {
+    RunAll<__uint32_t>();
+}
+
+TEST(ThroughputBenchmark, DISABLED_RV64) {
+    RunAll<__uint64_t>();
+}
@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <TraceRecorder.hpp>
+
+namespace {
+
+std::string TracePath(const char* name) {
+    return ::testing::TempDir() + name;
+}
+
+std::vector<unsigned char> FileBytes(const std::string& path) {
+    std::vector<unsigned char> bytes;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return bytes;
+    }
+    int byte;
+    while ((byte = getc(file)) != EOF) {
+        bytes.push_back(byte);
+    }
+    fclose(file);
+    return bytes;
+}
+
+} // namespace
+
+TEST(TraceRecorder, RoundTrips) {
+    std::vector<TraceReader::Entry> recorded = {
+        { TraceRecorder::Instruction, 0x10000, 0x00000513, 0 },
+        { TraceRecorder::Instruction, 0x10004, 0x4501, 0 },
+        { TraceRecorder::Read, 0x200000, 0, 8 },
+        { TraceRecorder::Read, 0x200008, 0, 8 },
+        { TraceRecorder::Write, 0x1ff000, 0, 4 },
+        { TraceRecorder::Instruction, 0xffc, 0xffdff06f, 0 },
+        { TraceRecorder::Trap, 0x1000, 0, 0 },
+        { TraceRecorder::Instruction, 0xffffffff80000000, 0x30200073, 0 },
+        { TraceRecorder::Write, 0x2, 0, 1 },
+        { TraceRecorder::Read, 0xfffffffffffffffe, 0, 2 },
+    };
+    std::string path = TracePath("round_trip.hmtrace");
+    {
+        TraceRecorder recorder(path.c_str());
+        ASSERT_TRUE(recorder.IsOpen());
+        for (const TraceReader::Entry& entry : recorded) {
+            if (entry.kind == TraceRecorder::Instruction) {
+                recorder.RecordInstruction(entry.address, entry.encoding);
+            } else if (entry.kind == TraceRecorder::Trap) {
+                recorder.RecordTrap(entry.address);
+            } else {
+                recorder.RecordAccess(entry.kind, entry.address, entry.size);
+            }
+        }
+    }
+
+    TraceReader reader(path.c_str());
+    ASSERT_TRUE(reader.IsOpen());
+    TraceReader::Entry entry;
+    for (const TraceReader::Entry& expected : recorded) {
+        ASSERT_TRUE(reader.Next(&entry));
+        EXPECT_EQ(entry.kind, expected.kind);
+        EXPECT_EQ(entry.address, expected.address);
+        EXPECT_EQ(entry.encoding, expected.encoding);
+        EXPECT_EQ(entry.size, expected.size);
+    }
+    EXPECT_FALSE(reader.Next(&entry));
+    remove(path.c_str());
+}
+
+// Scatter-gather transfers record whatever size they moved.
+TEST(TraceRecorder, RoundTripsOddSizes) {
+    std::vector<TraceReader::Entry> recorded = {
+        { TraceRecorder::Read, 0x80001000, 0, 3 },
+        { TraceRecorder::Read, 0x80001003, 0, 8 },
+        { TraceRecorder::Write, 0x80002000, 0, 0x1234 },
+        { TraceRecorder::Read, 0x80003234, 0, 4 },
+        { TraceRecorder::Write, 0x80001000, 0, 300 },
+    };
+    std::string path = TracePath("odd_sizes.hmtrace");
+    {
+        TraceRecorder recorder(path.c_str());
+        for (const TraceReader::Entry& entry : recorded) {
+            recorder.RecordAccess(entry.kind, entry.address, entry.size);
+        }
+    }
+
+    TraceReader reader(path.c_str());
+    ASSERT_TRUE(reader.IsOpen());
+    TraceReader::Entry entry;
+    for (const TraceReader::Entry& expected : recorded) {
+        ASSERT_TRUE(reader.Next(&entry));
+        EXPECT_EQ(entry.kind, expected.kind);
+        EXPECT_EQ(entry.address, expected.address);
+        EXPECT_EQ(entry.size, expected.size);
+    }
+    EXPECT_FALSE(reader.Next(&entry));
+    remove(path.c_str());
+}
+
+TEST(TraceRecorder, EncodesSequentialAccessesInTwoBytes) {
+    std::string path = TracePath("sequential.hmtrace");
+    {
+        TraceRecorder recorder(path.c_str());
+        recorder.RecordAccess(TraceRecorder::Read, 0x1000, 4);
+        recorder.RecordAccess(TraceRecorder::Read, 0x1004, 4);
+    }
+    // Tag 0b1001 (a 4-byte read), then zigzag(0x1000) and zigzag(0).
+    std::vector<unsigned char> expected = { 'H', 'M', 'T', 'R', 'A', 'C', 'E', '1', 0x09, 0x80, 0x40, 0x09, 0x00 };
+    EXPECT_EQ(FileBytes(path), expected);
+    remove(path.c_str());
+}
+
+TEST(TraceRecorder, ReaderStopsAtTruncatedRecord) {
+    std::string path = TracePath("truncated.hmtrace");
+    {
+        TraceRecorder recorder(path.c_str());
+        recorder.RecordInstruction(0x10000, 0x00000513);
+    }
+    std::vector<unsigned char> bytes = FileBytes(path);
+    FILE* file = fopen(path.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    fwrite(bytes.data(), 1, bytes.size() - 1, file);
+    fclose(file);
+
+    TraceReader reader(path.c_str());
+    ASSERT_TRUE(reader.IsOpen());
+    TraceReader::Entry entry;
+    EXPECT_FALSE(reader.Next(&entry));
+    remove(path.c_str());
+}
@@ -0,0 +1,146 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <Transactors/DirectTransactor.hpp>
+#include <Transactors/TranslatingTransactor.hpp>
+#include <Transactors/VirtToHostTransactor.hpp>
+#include <Translators/DirectTranslator.hpp>
+
+#include <PhysicalMemory.hpp>
+
+// Scatter-gather transfers stop at the exact byte that faults, having moved
+// everything before it and nothing after, whether the fault is part way
+// through one segment or in a later segment than the first.
+
+namespace {
+
+constexpr __uint32_t rootTable = 0x100000;
+constexpr __uint32_t mappedBase = 0x10000;
+constexpr __uint32_t mappedPages = 3;
+constexpr __uint32_t unmapped = mappedBase + mappedPages * 0x1000;
+
+constexpr __uint32_t extensions = (1 << ('I' - 'A')) | (1 << ('S' - 'A')) | (1 << ('U' - 'A'));
+
+inline char Pattern(__uint32_t address) {
+    return (char)(address * 7);
+}
+
+// Supervisor mode, with mappedPages identity-mapped 4K pages at mappedBase
+// and nothing above them.
+template<typename XLEN_t>
+struct Guest {
+
+    static constexpr unsigned int levels = sizeof(XLEN_t) == 4 ? 2 : 3;
+    static constexpr unsigned int vpnBits = sizeof(XLEN_t) == 4 ? 10 : 9;
+
+    std::unique_ptr<CASK::PhysicalMemory> memory = std::make_unique<CASK::PhysicalMemory>();
+    HartState<XLEN_t> state;
+
+    Guest() : state(extensions) {
+        XLEN_t nextTable = rootTable + 0x1000;
+        for (XLEN_t page = mappedBase; page < unmapped; page += 0x1000) {
+            XLEN_t table = rootTable;
+            for (unsigned int level = levels - 1; level > 0; level--) {
+                XLEN_t vpn = (page >> (12 + level * vpnBits)) & ((1 << vpnBits) - 1);
+                XLEN_t pte;
+                memory->Read<XLEN_t>(table + vpn * sizeof(XLEN_t), sizeof(XLEN_t), (char*)&pte);
+                if ((pte & 1) == 0) {
+                    pte = ((nextTable >> 12) << 10) | 0b1;
+                    memory->Write<XLEN_t>(table + vpn * sizeof(XLEN_t), sizeof(XLEN_t), (char*)&pte);
+                    nextTable += 0x1000;
+                }
+                table = (pte >> 10) << 12;
+            }
+            XLEN_t pte = ((page >> 12) << 10) | 0b11001111; // D A - - X W R V
+            memory->Write<XLEN_t>(table + ((page >> 12) & ((1 << vpnBits) - 1)) * sizeof(XLEN_t), sizeof(XLEN_t), (char*)&pte);
+            char contents[0x1000];
+            for (XLEN_t offset = 0; offset < 0x1000; offset++) {
+                contents[offset] = Pattern(page + offset);
+            }
+            memory->Write<XLEN_t>(page, sizeof(contents), contents);
+        }
+        state.satp.pagingMode = sizeof(XLEN_t) == 4 ? RISCV::PagingMode::Sv32 : RISCV::PagingMode::Sv39;
+        state.satp.ppn = rootTable >> 12;
+        state.privilegeMode = RISCV::PrivilegeMode::Supervisor;
+    }
+
+    std::vector<char> Contents(XLEN_t address, XLEN_t size) {
+        std::vector<char> contents(size);
+        memory->Read<XLEN_t>(address, size, contents.data());
+        return contents;
+    }
+
+};
+
+template<typename XLEN_t, typename TransactorT>
+void CheckFaultOffsets(Guest<XLEN_t>& guest, TransactorT& transactor) {
+
+    // A read running off the last mapped page.
+    std::vector<char> buf(32, 0);
+    TransferSegment<XLEN_t> segment = { unmapped - 12, 32, buf.data() };
+    SegmentsTransaction<XLEN_t> result = transactor.template TransactSegments<IOVerb::Read>(&segment, 1);
+    EXPECT_NE(result.trapCause, RISCV::TrapCause::NONE);
+    EXPECT_EQ(result.transferred, 12);
+    EXPECT_EQ(result.faultAddress, unmapped);
+    for (unsigned int i = 0; i < 12; i++) {
+        EXPECT_EQ(buf[i], Pattern(unmapped - 12 + i));
+    }
+    EXPECT_EQ(buf[12], 0);
+
+    // Writes where the second segment crosses from the second mapped page to
+    // the third, and the third segment runs off the end.
+    std::vector<char> first(100, 0x5a);
+    std::vector<char> second(40, 0x3c);
+    std::vector<char> third(40, 0x77);
+    TransferSegment<XLEN_t> segments[] = {
+        { mappedBase + 0x800, 100, first.data() },
+        { mappedBase + 0x2000 - 20, 40, second.data() },
+        { unmapped - 8, 40, third.data() },
+    };
+    result = transactor.template TransactSegments<IOVerb::Write>(segments, 3);
+    EXPECT_NE(result.trapCause, RISCV::TrapCause::NONE);
+    EXPECT_EQ(result.transferred, 148);
+    EXPECT_EQ(result.faultAddress, unmapped);
+    EXPECT_EQ(guest.Contents(mappedBase + 0x800, 100), first);
+    EXPECT_EQ(guest.Contents(mappedBase + 0x2000 - 20, 40), second);
+    EXPECT_EQ(guest.Contents(unmapped - 8, 8), std::vector<char>(8, 0x77));
+    EXPECT_EQ(guest.Contents(unmapped - 9, 1)[0], Pattern(unmapped - 9));
+}
+
+template<typename XLEN_t, bool buffered>
+void CheckTranslatingTransactor() {
+    Guest<XLEN_t> guest;
+    DirectTransactor<XLEN_t> paTransactor(guest.memory.get());
+    DirectTranslator<XLEN_t, DirectTransactor<XLEN_t>> translator(&guest.state, &paTransactor);
+    TranslatingTransactor<XLEN_t, buffered, DirectTranslator<XLEN_t, DirectTransactor<XLEN_t>>, DirectTransactor<XLEN_t>>
+        transactor(&translator, &paTransactor);
+    CheckFaultOffsets(guest, transactor);
+}
+
+template<typename XLEN_t>
+void CheckVirtToHostTransactor() {
+    Guest<XLEN_t> guest;
+    std::unique_ptr<VirtToHostTransactor<XLEN_t, 8>> transactor =
+        std::make_unique<VirtToHostTransactor<XLEN_t, 8>>(guest.memory.get(), &guest.state);
+    CheckFaultOffsets(guest, *transactor);
+}
+
+} // namespace
+
+TEST(TransferSegments, ImmediateTranslatingTransactor) {
+    CheckTranslatingTransactor<__uint32_t, false>();
+    CheckTranslatingTransactor<__uint64_t, false>();
+}
+
+TEST(TransferSegments, BufferedTranslatingTransactor) {
+    CheckTranslatingTransactor<__uint32_t, true>();
+    CheckTranslatingTransactor<__uint64_t, true>();
+}
+
+TEST(TransferSegments, VirtToHostTransactor) {
+    CheckVirtToHostTransactor<__uint32_t>();
+    CheckVirtToHostTransactor<__uint64_t>();
+}
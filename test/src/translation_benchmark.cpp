@@ -0,0 +1,298 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <HostMemoryMap.hpp>
+#include <Transactors/DirectTransactor.hpp>
+#include <Transactors/TranslatingTransactor.hpp>
+#include <Transactors/VirtToHostTransactor.hpp>
+#include <Translators/DirectTranslator.hpp>
+#include <Translators/CacheWrappedTranslator.hpp>
+
+#include <PhysicalMemory.hpp>
+
+#include "Benchmark.hpp"
+
+// Address translation microbenchmarks. Each fixture maps a 16 MiB region
+// (with 4K pages or superpages, or not at all for Bare), and each access
+// pattern over it is run through every translator and transactor stack,
+// reporting the time per access and the page walks per access. Walks are
+// counted at the walker's transactor, except inside VirtToHostTransactor,
+// whose walks are only counted when built with HARTMODELS_PERF_COUNTERS (and
+// are reported as null otherwise). VirtToHostTransactor runs with the memory
+// in a HostMemoryMap, as it does under OptimizedHart::AttachHostMemory(), so
+// superpages are cached whole; one row runs without, for comparison.
+
+namespace {
+
+constexpr __uint32_t regionBase = 0x400000;
+constexpr __uint32_t regionSize = 0x1000000;
+constexpr __uint32_t rootTable = 0x100000;
+
+// The largest translation cache benchmarked has 1 << largestCacheBits entries.
+constexpr unsigned int largestCacheBits = 10;
+
+// The physical side of a page walker, counting walks as reads of the root
+// table, which every walk starts with.
+template<typename XLEN_t>
+class CountingTransactor final : public Transactor<XLEN_t> {
+
+private:
+
+    DirectTransactor<XLEN_t> transactor;
+
+public:
+
+    unsigned long long walks = 0;
+
+    CountingTransactor(CASK::IOTarget* target) : transactor(target) { }
+
+    virtual Transaction<XLEN_t> Read(XLEN_t startAddress, XLEN_t size, char* buf) override {
+        if (startAddress - rootTable < 0x1000) {
+            walks++;
+        }
+        return transactor.Read(startAddress, size, buf);
+    }
+
+    virtual Transaction<XLEN_t> Write(XLEN_t startAddress, XLEN_t size, char* buf) override {
+        return transactor.Write(startAddress, size, buf);
+    }
+
+    virtual Transaction<XLEN_t> Fetch(XLEN_t startAddress, XLEN_t size, char* buf) override {
+        return transactor.Fetch(startAddress, size, buf);
+    }
+
+};
+
+struct Fixture {
+    const char* name;
+    RISCV::PagingMode mode;
+    unsigned int levels;
+    unsigned int leafLevel; // 0 for 4K pages, 1 for superpages
+};
+
+template<typename XLEN_t>
+std::vector<Fixture> Fixtures() {
+    if constexpr (sizeof(XLEN_t) == 4) {
+        return {
+            { "Bare", RISCV::PagingMode::Bare, 0, 0 },
+            { "Sv32", RISCV::PagingMode::Sv32, 2, 0 },
+            { "Sv32-megapages", RISCV::PagingMode::Sv32, 2, 1 },
+        };
+    } else {
+        return {
+            { "Bare", RISCV::PagingMode::Bare, 0, 0 },
+            { "Sv39", RISCV::PagingMode::Sv39, 3, 0 },
+            { "Sv39-megapages", RISCV::PagingMode::Sv39, 3, 1 },
+            { "Sv48", RISCV::PagingMode::Sv48, 4, 0 },
+            { "Sv48-megapages", RISCV::PagingMode::Sv48, 4, 1 },
+        };
+    }
+}
+
+// Identity-map the region with pages of the fixture's size.
+template<typename XLEN_t>
+void BuildPageTables(CASK::PhysicalMemory& memory, const Fixture& fixture) {
+    constexpr unsigned int vpnBits = sizeof(XLEN_t) == 4 ? 10 : 9;
+    constexpr XLEN_t pteSize = sizeof(XLEN_t);
+    constexpr XLEN_t leaf = 0b11001111; // D A - - X W R V
+    constexpr XLEN_t pointer = 0b00000001;
+    XLEN_t pageSize = (XLEN_t)0x1000 << (fixture.leafLevel * vpnBits);
+    XLEN_t nextTable = rootTable + 0x1000;
+    for (XLEN_t page = regionBase; page < regionBase + regionSize; page += pageSize) {
+        XLEN_t table = rootTable;
+        for (unsigned int level = fixture.levels - 1; level > fixture.leafLevel; level--) {
+            XLEN_t vpn = (page >> (12 + level * vpnBits)) & ((1 << vpnBits) - 1);
+            XLEN_t pte;
+            memory.Read<XLEN_t>(table + vpn * pteSize, pteSize, (char*)&pte);
+            if ((pte & 1) == 0) {
+                pte = ((nextTable >> 12) << 10) | pointer;
+                memory.Write<XLEN_t>(table + vpn * pteSize, pteSize, (char*)&pte);
+                nextTable += 0x1000;
+            }
+            table = (pte >> 10) << 12;
+        }
+        XLEN_t vpn = (page >> (12 + fixture.leafLevel * vpnBits)) & ((1 << vpnBits) - 1);
+        XLEN_t pte = ((page >> 12) << 10) | leaf;
+        memory.Write<XLEN_t>(table + vpn * pteSize, pteSize, (char*)&pte);
+    }
+}
+
+struct Pattern {
+    const char* name;
+    std::vector<__uint32_t> addresses;
+};
+
+// XLEN-sized accesses, all inside the region.
+template<typename XLEN_t>
+std::vector<Pattern> Patterns() {
+    constexpr size_t count = 1 << 20;
+    std::vector<Pattern> patterns = {
+        { "sequential", {} }, { "strided", {} }, { "random", {} }, { "thrashing", {} }, { "page-crossing", {} },
+    };
+    std::mt19937 random(1);
+    for (size_t i = 0; i < count; i++) {
+        // Word after word.
+        patterns[0].addresses.push_back(regionBase + (i * sizeof(XLEN_t)) % regionSize);
+        // A cache line apart, so 64 accesses per page.
+        patterns[1].addresses.push_back(regionBase + (i * 64) % regionSize);
+        patterns[2].addresses.push_back(regionBase + (random() % (regionSize / sizeof(XLEN_t))) * sizeof(XLEN_t));
+        // Every page in the region, more than the largest translation cache
+        // holds, in runs of pages whose indices are the same in every cache
+        // size, so each access evicts the page the next one in its run needs.
+        constexpr size_t ways = (regionSize >> 12) >> largestCacheBits;
+        size_t page = ((i % ways) << largestCacheBits) + (i / ways) % (1 << largestCacheBits);
+        patterns[3].addresses.push_back(regionBase + page * 0x1000);
+        // Straddling the end of each page in turn, up to the last one, which
+        // has no page after it in the region.
+        patterns[4].addresses.push_back(regionBase + (i * 0x1000) % (regionSize - 0x1000) + 0x1000 - sizeof(XLEN_t) / 2);
+    }
+    return patterns;
+}
+
+// Walks are negative when they weren't counted.
+template<typename XLEN_t>
+void Report(const char* fixture, const char* pattern, const std::string& stack, double seconds, size_t accesses, double walks) {
+    Benchmark::Result result(stack + "." + fixture + "." + pattern);
+    result.Text("fixture", fixture)
+          .Count("xlen", sizeof(XLEN_t) * 8)
+          .Text("pattern", pattern)
+          .Text("stack", stack)
+          .Count("accesses", accesses)
+          .Measure("ns_per_access", seconds * 1e9 / accesses);
+    if (walks >= 0) {
+        result.Measure("walks_per_access", walks / accesses, 4);
+    } else {
+        result.Unmeasured("walks_per_access");
+    }
+    result.Report();
+}
+
+// One untimed pass to warm up, then one timed pass.
+template<typename XLEN_t, typename TransactorType>
+double TimeAccesses(TransactorType& transactor, const Pattern& pattern) {
+    XLEN_t value;
+    XLEN_t sink = 0;
+    for (__uint32_t address : pattern.addresses) {
+        transactor.Read(address, sizeof(value), (char*)&value);
+        sink ^= value;
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (__uint32_t address : pattern.addresses) {
+        transactor.Read(address, sizeof(value), (char*)&value);
+        sink ^= value;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    volatile XLEN_t keep = sink;
+    (void)keep;
+    return seconds;
+}
+
+template<typename XLEN_t>
+void PrepareState(HartState<XLEN_t>& state, const Fixture& fixture) {
+    state.satp.pagingMode = fixture.mode;
+    state.satp.ppn = rootTable >> 12;
+    state.privilegeMode = RISCV::PrivilegeMode::Supervisor;
+}
+
+// A walker, optionally behind a translation cache, feeding a translating
+// transactor.
+template<typename XLEN_t, bool buffered, unsigned int cacheBits>
+void RunTranslatingStack(CASK::PhysicalMemory* memory, const Fixture& fixture, const Pattern& pattern) {
+    HartState<XLEN_t> state(Benchmark::extensions);
+    PrepareState(state, fixture);
+    CountingTransactor<XLEN_t> walker(memory);
+    DirectTransactor<XLEN_t> paTransactor(memory);
+    using Walker = DirectTranslator<XLEN_t, CountingTransactor<XLEN_t>>;
+    Walker translator(&state, &walker);
+    std::string stack = std::string("DirectTranslator+TranslatingTransactor<") + (buffered ? "buffered" : "immediate") + ">";
+    double seconds;
+    if constexpr (cacheBits == 0) {
+        TranslatingTransactor<XLEN_t, buffered, Walker, DirectTransactor<XLEN_t>> transactor(&translator, &paTransactor);
+        seconds = TimeAccesses<XLEN_t>(transactor, pattern);
+    } else {
+        using Cached = CacheWrappedTranslator<XLEN_t, cacheBits, Walker>;
+        std::unique_ptr<Cached> cached = std::make_unique<Cached>(&translator);
+        TranslatingTransactor<XLEN_t, buffered, Cached, DirectTransactor<XLEN_t>> transactor(cached.get(), &paTransactor);
+        seconds = TimeAccesses<XLEN_t>(transactor, pattern);
+        stack = "CacheWrappedTranslator<" + std::to_string(cacheBits) + ">+" + stack.substr(stack.find('+') + 1);
+    }
+    // Walks are counted over both passes.
+    Report<XLEN_t>(fixture.name, pattern.name, stack, seconds, pattern.addresses.size(), walker.walks / 2.0);
+}
+
+// A copy of everything up to the end of the region, page tables included,
+// in host memory, for VirtToHostTransactor to find through a HostMemoryMap.
+template<typename XLEN_t>
+struct HostCopy {
+    std::vector<char> bytes = std::vector<char>(regionBase + regionSize);
+    HostMemoryMap<XLEN_t> map;
+
+    HostCopy(CASK::PhysicalMemory& memory) {
+        for (XLEN_t page = 0; page < bytes.size(); page += 0x1000) {
+            memory.Read<XLEN_t>(page, 0x1000, bytes.data() + page);
+        }
+        map.Add(0, bytes.size(), bytes.data());
+    }
+};
+
+template<typename XLEN_t, unsigned int cacheBits>
+void RunVirtToHostStack(CASK::PhysicalMemory* memory, const HostMemoryMap<XLEN_t>* map, const Fixture& fixture, const Pattern& pattern) {
+    HartState<XLEN_t> state(Benchmark::extensions);
+    PrepareState(state, fixture);
+    using VirtToHost = VirtToHostTransactor<XLEN_t, cacheBits>;
+    std::unique_ptr<VirtToHost> transactor = std::make_unique<VirtToHost>(memory, &state);
+    std::string stack = "VirtToHostTransactor<" + std::to_string(cacheBits) + ">";
+    if (map != nullptr) {
+        transactor->SetHostMemoryMap(map);
+    } else {
+        stack += "-unmapped";
+    }
+    double seconds = TimeAccesses<XLEN_t>(*transactor, pattern);
+#ifdef HARTMODELS_PERF_COUNTERS
+    double walks = fixture.mode == RISCV::PagingMode::Bare ? 0 : transactor->perf.translations / 2.0;
+#else
+    double walks = -1;
+#endif
+    Report<XLEN_t>(fixture.name, pattern.name, stack, seconds, pattern.addresses.size(), walks);
+}
+
+template<typename XLEN_t>
+void RunAll() {
+    std::vector<Pattern> patterns = Patterns<XLEN_t>();
+    for (const Fixture& fixture : Fixtures<XLEN_t>()) {
+        std::unique_ptr<CASK::PhysicalMemory> memory = std::make_unique<CASK::PhysicalMemory>();
+        if (fixture.mode != RISCV::PagingMode::Bare) {
+            BuildPageTables<XLEN_t>(*memory, fixture);
+        }
+        std::unique_ptr<HostCopy<XLEN_t>> host = std::make_unique<HostCopy<XLEN_t>>(*memory);
+        for (const Pattern& pattern : patterns) {
+            RunTranslatingStack<XLEN_t, false, 0>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, true, 0>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, false, 6>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, true, 6>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, false, 8>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, true, 8>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, false, largestCacheBits>(memory.get(), fixture, pattern);
+            RunTranslatingStack<XLEN_t, true, largestCacheBits>(memory.get(), fixture, pattern);
+            RunVirtToHostStack<XLEN_t, 6>(memory.get(), &host->map, fixture, pattern);
+            RunVirtToHostStack<XLEN_t, 8>(memory.get(), &host->map, fixture, pattern);
+            RunVirtToHostStack<XLEN_t, largestCacheBits>(memory.get(), &host->map, fixture, pattern);
+            RunVirtToHostStack<XLEN_t, largestCacheBits>(memory.get(), nullptr, fixture, pattern);
+        }
+    }
+}
+
+} // namespace
+
+TEST(TranslationBenchmark, DISABLED_RV32) {
+    RunAll<__uint32_t>();
+}
+
+TEST(TranslationBenchmark, DISABLED_RV64) {
+    RunAll<__uint64_t>();
+}
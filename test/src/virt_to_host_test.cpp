@@ -0,0 +1,306 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <HostMemoryMap.hpp>
+#include <Transactors/VirtToHostTransactor.hpp>
+
+#include <PhysicalMemory.hpp>
+
+// VirtToHostTransactor over guest RAM that lives in a host buffer registered
+// in a HostMemoryMap. The bus behind it is left empty, so whatever comes back
+// through the transactor, page tables included, came from the map.
+
+namespace {
+
+constexpr __uint32_t ramSize = 0x800000;
+constexpr __uint32_t rootTable = 0x100000;
+constexpr __uint32_t tableSpace = 0x10000;
+constexpr __uint32_t superpageBase = 0x400000;
+
+constexpr __uint32_t extensions = (1 << ('I' - 'A')) | (1 << ('S' - 'A')) | (1 << ('U' - 'A'));
+
+inline char Pattern(__uint32_t address) {
+    return (char)(address * 7);
+}
+
+// Supervisor mode with nothing mapped until Map() is called.
+template<typename XLEN_t>
+struct MappedGuest {
+
+    static constexpr unsigned int levels = sizeof(XLEN_t) == 4 ? 2 : 3;
+    static constexpr unsigned int vpnBits = sizeof(XLEN_t) == 4 ? 10 : 9;
+    static constexpr XLEN_t megapageSize = (XLEN_t)0x1000 << vpnBits;
+
+    std::unique_ptr<CASK::PhysicalMemory> bus = std::make_unique<CASK::PhysicalMemory>();
+    std::vector<char> ram = std::vector<char>(ramSize);
+    HostMemoryMap<XLEN_t> map;
+    HartState<XLEN_t> state;
+    XLEN_t nextTable = rootTable + 0x1000;
+
+    MappedGuest() : state(extensions) {
+        for (__uint32_t address = 0; address < ramSize; address++) {
+            ram[address] = Pattern(address);
+        }
+        memset(ram.data() + rootTable, 0, tableSpace);
+        map.Add(0, ramSize, ram.data());
+        state.satp.pagingMode = sizeof(XLEN_t) == 4 ? RISCV::PagingMode::Sv32 : RISCV::PagingMode::Sv39;
+        state.satp.ppn = rootTable >> 12;
+        state.privilegeMode = RISCV::PrivilegeMode::Supervisor;
+    }
+
+    // Map the page holding address to physical page target, with a leaf at
+    // leafLevel (1 for a megapage). Returns where the leaf PTE lives.
+    XLEN_t Map(XLEN_t address, XLEN_t target, unsigned int leafLevel = 0) {
+        XLEN_t table = rootTable;
+        for (unsigned int level = levels - 1; level > leafLevel; level--) {
+            XLEN_t entry = Entry(table, address, level);
+            if ((ReadPTE(entry) & 1) == 0) {
+                WritePTE(entry, ((nextTable >> 12) << 10) | 0b1);
+                nextTable += 0x1000;
+            }
+            table = (ReadPTE(entry) >> 10) << 12;
+        }
+        XLEN_t leaf = Entry(table, address, leafLevel);
+        WritePTE(leaf, ((target >> 12) << 10) | 0b11001111); // D A - - X W R V
+        return leaf;
+    }
+
+    XLEN_t ReadPTE(XLEN_t entry) {
+        XLEN_t pte;
+        memcpy(&pte, ram.data() + entry, sizeof(pte));
+        return pte;
+    }
+
+    void WritePTE(XLEN_t entry, XLEN_t pte) {
+        memcpy(ram.data() + entry, &pte, sizeof(pte));
+    }
+
+    std::vector<char> Expected(XLEN_t physical, XLEN_t size) {
+        std::vector<char> expected(size);
+        for (XLEN_t i = 0; i < size; i++) {
+            expected[i] = Pattern(physical + i);
+        }
+        return expected;
+    }
+
+private:
+
+    static XLEN_t Entry(XLEN_t table, XLEN_t address, unsigned int level) {
+        XLEN_t vpn = (address >> (12 + level * vpnBits)) & ((1 << vpnBits) - 1);
+        return table + vpn * sizeof(XLEN_t);
+    }
+
+};
+
+template<typename XLEN_t>
+using Transactor8 = VirtToHostTransactor<XLEN_t, 8>;
+
+template<typename XLEN_t>
+std::vector<char> ReadThrough(Transactor8<XLEN_t>& transactor, XLEN_t address, XLEN_t size, RISCV::TrapCause* trap) {
+    std::vector<char> contents(size);
+    *trap = transactor.Read(address, size, contents.data()).trapCause;
+    return contents;
+}
+
+template<typename XLEN_t>
+void CheckMegapageFilledOnce() {
+    MappedGuest<XLEN_t> guest;
+    XLEN_t leaf = guest.Map(superpageBase, superpageBase, 1);
+    std::unique_ptr<Transactor8<XLEN_t>> transactor = std::make_unique<Transactor8<XLEN_t>>(guest.bus.get(), &guest.state);
+    transactor->SetHostMemoryMap(&guest.map);
+
+    RISCV::TrapCause trap;
+    EXPECT_EQ(ReadThrough<XLEN_t>(*transactor, superpageBase, 4, &trap), guest.Expected(superpageBase, 4));
+    ASSERT_EQ(trap, RISCV::TrapCause::NONE);
+
+    // With the leaf gone, only a translation cached by that first read can
+    // reach the rest of the megapage.
+    guest.WritePTE(leaf, 0);
+    for (XLEN_t offset = 0x1000; offset < guest.megapageSize; offset += guest.megapageSize / 8) {
+        EXPECT_EQ(ReadThrough<XLEN_t>(*transactor, superpageBase + offset, 8, &trap), guest.Expected(superpageBase + offset, 8));
+        EXPECT_EQ(trap, RISCV::TrapCause::NONE);
+    }
+    XLEN_t last = superpageBase + guest.megapageSize - 8;
+    EXPECT_EQ(ReadThrough<XLEN_t>(*transactor, last, 8, &trap), guest.Expected(last, 8));
+    EXPECT_EQ(trap, RISCV::TrapCause::NONE);
+}
+
+template<typename XLEN_t>
+void CheckRestoreWhileLogging() {
+    MappedGuest<XLEN_t> guest;
+    guest.Map(0x200000, 0x200000);
+    std::unique_ptr<Transactor8<XLEN_t>> transactor = std::make_unique<Transactor8<XLEN_t>>(guest.bus.get(), &guest.state);
+    transactor->SetHostMemoryMap(&guest.map);
+    std::vector<char> stored(8, 0x5a);
+    ASSERT_EQ(transactor->Write(0x200000, 8, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    std::unique_ptr<typename Transactor8<XLEN_t>::Caches> caches = std::make_unique<typename Transactor8<XLEN_t>::Caches>();
+    transactor->SaveCaches(caches.get());
+
+    // The saved write entry was filled before logging began, so a store
+    // through it would escape the log.
+    transactor->LogWrites(true);
+    transactor->RestoreCaches(caches.get());
+    std::vector<char> logged(8, 0x3c);
+    ASSERT_EQ(transactor->Write(0x200000, 8, logged.data()).trapCause, RISCV::TrapCause::NONE);
+    transactor->RollBackWrites();
+    EXPECT_EQ(std::vector<char>(guest.ram.begin() + 0x200000, guest.ram.begin() + 0x200008), stored);
+}
+
+template<typename XLEN_t>
+void CheckBypassesBus() {
+    MappedGuest<XLEN_t> guest;
+    guest.Map(0x200000, 0x300000);
+    std::unique_ptr<Transactor8<XLEN_t>> transactor = std::make_unique<Transactor8<XLEN_t>>(guest.bus.get(), &guest.state);
+    transactor->SetHostMemoryMap(&guest.map);
+
+    // The page tables and the data are only in the host buffer; the empty
+    // bus would have the walk fault.
+    RISCV::TrapCause trap;
+    EXPECT_EQ(ReadThrough<XLEN_t>(*transactor, 0x200010, 16, &trap), guest.Expected(0x300010, 16));
+    ASSERT_EQ(trap, RISCV::TrapCause::NONE);
+
+    std::vector<char> stored(8, 0x5a);
+    ASSERT_EQ(transactor->Write(0x200ff8, 8, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    EXPECT_EQ(std::vector<char>(guest.ram.begin() + 0x300ff8, guest.ram.begin() + 0x301000), stored);
+    std::vector<char> onBus(8, 0x11);
+    guest.bus->template Read<XLEN_t>(0x300ff8, 8, onBus.data());
+    EXPECT_EQ(onBus, std::vector<char>(8, 0));
+}
+
+// Whether a read of address still goes through the translation it was
+// cached with, after its leaf has been pointed at a Retarget()ed page.
+template<typename XLEN_t>
+bool StillCached(MappedGuest<XLEN_t>& guest, Transactor8<XLEN_t>& transactor, XLEN_t address, XLEN_t original) {
+    RISCV::TrapCause trap;
+    std::vector<char> contents = ReadThrough<XLEN_t>(transactor, address, 8, &trap);
+    EXPECT_EQ(trap, RISCV::TrapCause::NONE);
+    return contents == guest.Expected(original, 8);
+}
+
+// Point the leaf for address at a page filled with something Pattern()
+// never produces at its start.
+template<typename XLEN_t>
+void Retarget(MappedGuest<XLEN_t>& guest, XLEN_t address, XLEN_t target) {
+    memset(guest.ram.data() + target, 0x77, 0x1000);
+    guest.Map(address, target);
+}
+
+template<typename XLEN_t>
+void CheckFenceOneAddress() {
+    MappedGuest<XLEN_t> guest;
+    std::unique_ptr<Transactor8<XLEN_t>> transactor = std::make_unique<Transactor8<XLEN_t>>(guest.bus.get(), &guest.state);
+    transactor->SetHostMemoryMap(&guest.map);
+    for (XLEN_t page = 0; page < 4; page++) {
+        guest.Map(0x200000 + page * 0x1000, 0x300000 + page * 0x1000);
+        EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x200000 + page * 0x1000, 0x300000 + page * 0x1000));
+    }
+    for (XLEN_t page = 0; page < 4; page++) {
+        Retarget<XLEN_t>(guest, 0x200000 + page * 0x1000, 0x380000 + page * 0x1000);
+    }
+
+    transactor->Fence(0x201234, false, 0, true);
+    EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x200000, 0x300000));
+    EXPECT_FALSE(StillCached<XLEN_t>(guest, *transactor, 0x201000, 0x301000));
+    EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x202000, 0x302000));
+    EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x203000, 0x303000));
+}
+
+template<typename XLEN_t>
+void CheckFenceOneAsid() {
+    MappedGuest<XLEN_t> guest;
+    guest.state.satp.asid = 5;
+    std::unique_ptr<Transactor8<XLEN_t>> transactor = std::make_unique<Transactor8<XLEN_t>>(guest.bus.get(), &guest.state);
+    transactor->SetHostMemoryMap(&guest.map);
+    for (XLEN_t page = 0; page < 2; page++) {
+        guest.Map(0x200000 + page * 0x1000, 0x300000 + page * 0x1000);
+        EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x200000 + page * 0x1000, 0x300000 + page * 0x1000));
+        Retarget<XLEN_t>(guest, 0x200000 + page * 0x1000, 0x380000 + page * 0x1000);
+    }
+
+    // Another address space's fences, for one address or all of them, leave
+    // this one's translations alone.
+    transactor->Fence(0x200000, false, 6, false);
+    transactor->Fence(0, true, 6, false);
+    EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x200000, 0x300000));
+    EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x201000, 0x301000));
+
+    transactor->Fence(0x200000, false, 5, false);
+    EXPECT_FALSE(StillCached<XLEN_t>(guest, *transactor, 0x200000, 0x300000));
+    EXPECT_TRUE(StillCached<XLEN_t>(guest, *transactor, 0x201000, 0x301000));
+
+    transactor->Fence(0, true, 5, false);
+    EXPECT_FALSE(StillCached<XLEN_t>(guest, *transactor, 0x201000, 0x301000));
+}
+
+template<typename XLEN_t>
+void CheckCodeWritesReported() {
+    MappedGuest<XLEN_t> guest;
+    guest.Map(0x200000, 0x300000);
+    guest.Map(0x201000, 0x301000);
+    guest.Map(0x600000, 0x300000); // a second, data-only view of the code
+    std::unique_ptr<Transactor8<XLEN_t>> transactor = std::make_unique<Transactor8<XLEN_t>>(guest.bus.get(), &guest.state);
+    transactor->SetHostMemoryMap(&guest.map);
+    std::vector<std::pair<XLEN_t, XLEN_t>> reported;
+    transactor->codeWriteHook = [&reported](XLEN_t address, XLEN_t size) { reported.emplace_back(address, size); };
+
+    // Cache both views for writes before anything is watched.
+    std::vector<char> stored(4, 0x13);
+    ASSERT_EQ(transactor->Write(0x200000, 4, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    ASSERT_EQ(transactor->Write(0x600000, 4, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    __uint32_t encoding;
+    ASSERT_EQ(transactor->FetchInstruction(0x200100, &encoding).trapCause, RISCV::TrapCause::NONE);
+    transactor->WatchFetch(0x200100, 4);
+    EXPECT_TRUE(reported.empty());
+
+    // Stores to the code report where it was fetched from, whichever view
+    // they go through, and still land.
+    ASSERT_EQ(transactor->Write(0x200100, 4, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    ASSERT_EQ(transactor->Write(0x600ffc, 4, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    std::vector<std::pair<XLEN_t, XLEN_t>> expected = { { 0x200100, 4 }, { 0x200ffc, 4 } };
+    EXPECT_EQ(reported, expected);
+    EXPECT_EQ(std::vector<char>(guest.ram.begin() + 0x300100, guest.ram.begin() + 0x300104), stored);
+
+    // Nor is anything said about stores elsewhere.
+    ASSERT_EQ(transactor->Write(0x201000, 4, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    EXPECT_EQ(reported.size(), 2);
+
+    transactor->UnwatchAll();
+    ASSERT_EQ(transactor->Write(0x200100, 4, stored.data()).trapCause, RISCV::TrapCause::NONE);
+    EXPECT_EQ(reported.size(), 2);
+}
+
+} // namespace
+
+TEST(VirtToHostTransactor, CachesMegapageWholeWithHostMemoryMap) {
+    CheckMegapageFilledOnce<__uint32_t>();
+    CheckMegapageFilledOnce<__uint64_t>();
+}
+
+TEST(VirtToHostTransactor, LogsStoresThroughRestoredCaches) {
+    CheckRestoreWhileLogging<__uint32_t>();
+    CheckRestoreWhileLogging<__uint64_t>();
+}
+
+TEST(VirtToHostTransactor, BypassesBusWithHostMemoryMap) {
+    CheckBypassesBus<__uint32_t>();
+    CheckBypassesBus<__uint64_t>();
+}
+
+TEST(VirtToHostTransactor, FencesOneAddress) {
+    CheckFenceOneAddress<__uint32_t>();
+    CheckFenceOneAddress<__uint64_t>();
+}
+
+TEST(VirtToHostTransactor, FencesOneAsid) {
+    CheckFenceOneAsid<__uint32_t>();
+    CheckFenceOneAsid<__uint64_t>();
+}
+
+TEST(VirtToHostTransactor, ReportsStoresToWatchedCode) {
+    CheckCodeWritesReported<__uint32_t>();
+    CheckCodeWritesReported<__uint64_t>();
+}